@@ -8,7 +8,23 @@
 #include "config.h"
 #include "Host.h"
 #include "AvrPort.h"
+#include "FixedPoint.h"
 #include <math.h>
+#include <util/atomic.h>
+#include <util/delay.h>
+
+// What Axis::advanceStep waits before its pulse: the step low time, or the
+// longer of that and the DIR setup time when it turns DIR round.
+#ifdef STEP_PULSE_US
+#define ADVANCE_LOW_US STEP_PULSE_US
+#else
+#define ADVANCE_LOW_US 0
+#endif
+#if defined(STEP_DIR_DELAY_US) && STEP_DIR_DELAY_US > ADVANCE_LOW_US
+#define ADVANCE_DIR_US STEP_DIR_DELAY_US
+#else
+#define ADVANCE_DIR_US ADVANCE_LOW_US
+#endif
 
 class Axis
 {
@@ -32,6 +48,7 @@ class Axis
     steps_remaining = 0;
     minstop_pos = 10000;
     maxstop_pos = 10000;
+    recalc_fixed();
 
     // Initialize pins we control.
     if(!step_pin.isNull()) { step_pin.setDirection(true); step_pin.setValue(false); }
@@ -43,7 +60,7 @@ class Axis
     
   void dump_to_host()
   {
-    HOST.labelnum("p:",position,false);
+    HOST.labelnum("p:",getCurrentPosition(),false);
     HOST.labelnum(" sf:", start_feed, false);
     HOST.labelnum(" mf:", max_feed, false);
     HOST.labelnum(" ar:",accel_rate, false);
@@ -59,6 +76,15 @@ class Axis
     return a;
   }
 
+  // Step rate for feedrate (mm/min), in steps/sec with 8 bits of fraction;
+  // see Motion::interval_from_rate.
+  uint32_t rate_from_feedrate(float feedrate)
+  {
+    float r = feedrate * steps_per_unit * (256.0f / 60.0f);
+    if(r > 0xFFFFFF) r = 0xFFFFFF;
+    return r;
+  }
+
   inline uint32_t int_interval_from_feedrate(uint32_t feedrate)
   {
     // Max error - roughly 2.5%.  Only used for accel so not really a problem.
@@ -69,31 +95,26 @@ class Axis
 
 	bool isMoving() { return (steps_remaining > 0); };
   // Doesn't take into account position is not updated during move.
-  float getCurrentPosition() { return position; }
-  void  setCurrentPosition(float pos) { position = pos; }
-  void  setMinimumFeedrate(float feedrate) { if(feedrate <= 0) return; start_feed = feedrate; }
-  void  setMaximumFeedrate(float feedrate) { if(feedrate <= 0) return; max_feed = feedrate;  }
+  float getCurrentPosition() { return getPositionSteps() / steps_per_unit; }
+  void  setCurrentPosition(float pos) { int32_t p = getStepsFromMM(pos); ATOMIC_BLOCK(ATOMIC_RESTORESTATE) { position = p; } }
+  int32_t getPositionSteps() { int32_t p; ATOMIC_BLOCK(ATOMIC_RESTORESTATE) { p = position; } return p; }
+  // Nearest whole step to a position in mm.
+  int32_t getStepsFromMM(float mm) { float s = mm * steps_per_unit; return s < 0 ? s - 0.5f : s + 0.5f; }
+  void  setMinimumFeedrate(float feedrate) { if(feedrate <= 0) return; start_feed = feedrate; recalc_fixed(); }
+  void  setMaximumFeedrate(float feedrate) { if(feedrate <= 0) return; max_feed = feedrate; recalc_fixed(); }
   void  setAverageFeedrate(float feedrate) { if(feedrate <= 0) return;  }
-  void  setStepsPerUnit(float steps) { if(steps <= 0) return; steps_per_unit = steps; spu_int = steps; }
-  void  setAccel(float rate) { if(rate <= 0) return; accel_rate = rate; }
+  void  setStepsPerUnit(float steps) 
+  { 
+    if(steps <= 0) return; 
+    float mm = getCurrentPosition(); // keep the same position in mm
+    steps_per_unit = steps; spu_int = steps; recalc_fixed(); 
+    setCurrentPosition(mm);
+  }
+  void  setAccel(float rate) { if(rate <= 0) return; accel_rate = rate; recalc_fixed(); }
   float getAccel() { return accel_rate; }
   void  disable() { if(!enable_pin.isNull()) enable_pin.setValue(true); }
   void  enable() { if(!enable_pin.isNull()) enable_pin.setValue(false); }
 
-  float getMovesteps(float start, float end, bool& dir) 
-  { 
-    float d = end - start; 
-
-    if(d<0) 
-    {
-      d = d * -1; 
-      dir=false;
-    }
-    else
-      dir=true;
-    
-    return steps_per_unit * d; 
-  }
   float    getStartFeed(float feed) { return start_feed < feed ? start_feed : feed; }
   float    getStartFeed() { return start_feed; }
   float    getEndFeed(float feed) { return max_feed < feed ? max_feed : feed; }
@@ -114,13 +135,12 @@ class Axis
 
 
 
-  uint32_t getAccelDist(float start_feed, float end_feed, float accel) 
-  { 
-    end_feed /= 60.0f;
-    start_feed /= 60.0f;
-    float distance_in_mm = ((end_feed * end_feed) - (start_feed * start_feed)) / (2.0f * accel);
-    return distance_in_mm * steps_per_unit;
-  }
+  // Integer versions of the above for the planner; see recalc_fixed().
+  uint32_t getMicrons(uint32_t steps) { return mul_q16(steps, um_per_step); }
+  uint16_t getMaxFeedInt() { return max_feed_int; }
+  uint16_t getStartFeedInt() { return start_feed_int; }
+  // Steps to change speed, at this axis' accel, per (mm/min)^2; Q0.32
+  uint32_t getAccelDistScale() { return accel_dist_scale; }
   
   static float getFinalVelocity(float start_feed, float dist, float accel)
   {
@@ -134,51 +154,102 @@ class Axis
     return  sqrt((start_feed * start_feed) + (2.0f * accel * (float)((float)movesteps / steps_per_unit))) * 60.0f;
   }
 
-  float getEndpos(float start, uint32_t steps, bool dir) 
-  { 
-    return start + (float)((float)steps / steps_per_unit * (dir ? 1.0 : -1.0));
-  }
-
-  inline void doStep()
+  // Raises the step pin if the step is taken; true if it did.  Motion lowers
+  // it again with endStep() once the pulse has been held long enough.
+  inline bool doStep() { if(!takeStep()) return false; step_pin.setValue(true); return true; }
+  inline void endStep() { step_pin.setValue(false); }
+
+  // For boards with FIXED_STEP_PINS; see Motion::stepAxis.  The types must
+  // name the same pins the Axis was configured with.
+  template <class STEP, class MIN, class MAX>
+  inline void doStep() { if(takeStep<MIN, MAX>()) { STEP s; s.setValue(true); } }
+  template <class STEP>
+  static inline void endStep() { STEP s; s.setValue(false); }
+
+  // Checks the endstop and counts the step; true if the step pin should be
+  // pulsed.  Motion does the pulsing itself with GROUP_STEP_PULSES.
+  inline bool takeStep() { return takeStep(min_pin, max_pin); }
+  template <class MIN, class MAX>
+  inline bool takeStep() { MIN mn; MAX mx; return takeStep(mn, mx); }
+
+  template <class MIN, class MAX>
+  inline bool takeStep(MIN& minp, MAX& maxp)
   {
-    if(steps_remaining == 0) return;
+    if(steps_remaining == 0) return false;
     if(direction)
     {
-      if(!max_pin.isNull() && max_pin.getValue() != END_INVERT)
+      if(!maxp.isNull() && maxp.getValue() != END_INVERT)
       {
         if(maxstop_pos < 9000)
-          position = maxstop_pos;
+          position = getStepsFromMM(maxstop_pos);
         else
-          position += (float)(steps_to_take-steps_remaining) / steps_per_unit;
+          position += steps_to_take-steps_remaining;
         steps_remaining = 0;
-        return;
+        return false;
       }
     }
     else
     {
-      if(!min_pin.isNull() && min_pin.getValue() != END_INVERT)
+      if(!minp.isNull() && minp.getValue() != END_INVERT)
       {
         if(minstop_pos < 9000)
-          position = minstop_pos;
+          position = getStepsFromMM(minstop_pos);
         else
-          position -= (float)(steps_to_take-steps_remaining) / steps_per_unit;
+          position -= steps_to_take-steps_remaining;
         steps_remaining = 0;
-        return;
+        return false;
       }
     }
 
-    step_pin.setValue(true);
-    step_pin.setValue(false);
-
     if(--steps_remaining == 0)
     {
       //HOST.labelnum("FINISH MOVE, ", steps_to_take, true);
-      position += (float)((float)steps_to_take / steps_per_unit * (direction ? 1.0 : -1.0));
+      if(direction)
+        position += steps_to_take;
+      else
+        position -= steps_to_take;
       //if(disable_after_move) disable();
     }
+    return true;
+  }
+
+  template <class STEP>
+  static inline void pulse(STEP& step)
+  {
+    step.setValue(true);
+#ifdef STEP_PULSE_US
+    _delay_us(STEP_PULSE_US);
+#endif
+    step.setValue(false);
+  }
+
+  Pin& getStepPin() { return step_pin; }
+
+  // An extra step outside of the move, for linear advance; position isn't
+  // touched, Motion keeps count of how far ahead these have put us.  These can
+  // come straight after the move's last step (of a burst, too), and may go
+  // against DIR, so unlike the move's own steps they wait out the driver's step
+  // low time first, or its DIR setup time if they turn DIR round, and its DIR
+  // hold time before turning it back.  See STEP_PULSE_US and STEP_DIR_DELAY_US.
+  void advanceStep(bool forward)
+  {
+    bool flip = forward != direction;
+    if(flip)
+    {
+      dir_pin.setValue(forward != dir_inverted);
+      _delay_us(ADVANCE_DIR_US);
+    }
+    else
+      _delay_us(ADVANCE_LOW_US);
+    pulse(step_pin);
+    if(flip)
+    {
+      _delay_us(ADVANCE_DIR_US);
+      dir_pin.setValue(direction != dir_inverted);
+    }
   }
 
-  bool setupMove(float supposed_position, bool dir, uint32_t steps)
+  bool setupMove(int32_t supposed_position, bool dir, uint32_t steps)
   {
     if(supposed_position != position)
       return false;
@@ -193,6 +264,21 @@ class Axis
 
   uint32_t getRemainingSteps() { return steps_remaining; }
 
+  // Stop partway through the move, keeping the steps already taken; ahead is
+  // any taken outside it with advanceStep().  Call with the step interrupt off.
+  void abortMove(int32_t ahead)
+  {
+    if(steps_remaining > 0)
+    {
+      if(direction)
+        position += steps_to_take-steps_remaining;
+      else
+        position -= steps_to_take-steps_remaining;
+      steps_remaining = 0;
+    }
+    position += ahead;
+  }
+
   void disableIfConfigured() { if(disable_after_move) disable(); }
 
   void changepinStep(Port p, int bit)
@@ -278,9 +364,19 @@ class Axis
   float getStepsPerMM() { return steps_per_unit; }
 
 private:
+  // Only changes when the config does, so the planner needn't touch a float.
+  void recalc_fixed()
+  {
+    um_per_step = 65536000.0f / steps_per_unit;
+    max_feed_int = max_feed > 65535 ? 65535 : max_feed;
+    start_feed_int = start_feed > 65535 ? 65535 : start_feed;
+    float s = steps_per_unit * 4294967296.0f / (7200.0f * accel_rate);
+    accel_dist_scale = s > 4294967295.0f ? 0xFFFFFFFF : s;
+  }
+
   static bool PULLUPS;
   static bool END_INVERT;
-  volatile float position;
+  volatile int32_t position; // in steps
 	volatile bool direction;
 	volatile uint32_t steps_to_take;
 	volatile uint32_t steps_remaining;
@@ -290,6 +386,9 @@ private:
 
   float    start_feed, max_feed;
   uint32_t accel_rate;
+  uint32_t um_per_step; // Q16.16 microns
+  uint32_t accel_dist_scale;
+  uint16_t max_feed_int, start_feed_int;
 
   int homing_dir;
   // Automatically set positions when hitting endstops.
@@ -0,0 +1,49 @@
+#ifndef _FIXEDPOINT_H_
+#define _FIXEDPOINT_H_
+/* Integer helpers for the move planner.
+ *
+ * The AVR has an 8x8 hardware multiply and nothing for floats, so these stick
+ * to 32-bit products of 16-bit halves; no 64-bit math either.
+ */
+
+#include <stdint.h>
+
+// a * b >> 16, where b is Q16.16.  Good as long as the result fits in 32 bits.
+static inline uint32_t mul_q16(uint32_t a, uint32_t b)
+{
+  uint32_t ah = a >> 16, al = a & 0xFFFF;
+  uint32_t bh = b >> 16, bl = b & 0xFFFF;
+  return a * bh + ah * bl + ((al * bl) >> 16);
+}
+
+// a * b >> 32, where b is a fraction in Q0.32.  Drops the low*low term, so it
+// can come out one or two short.
+static inline uint32_t mul_q32(uint32_t a, uint32_t b)
+{
+  uint32_t ah = a >> 16, al = a & 0xFFFF;
+  uint32_t bh = b >> 16, bl = b & 0xFFFF;
+  return ah * bh + ((ah * bl) >> 16) + ((al * bh) >> 16);
+}
+
+// floor(sqrt(n)), one result bit per pass.
+static inline uint16_t isqrt32(uint32_t n)
+{
+  uint32_t root = 0;
+  uint32_t bit = 1UL << 30;
+  while(bit > n)
+    bit >>= 2;
+  while(bit)
+  {
+    if(n >= root + bit)
+    {
+      n -= root + bit;
+      root = (root >> 1) + bit;
+    }
+    else
+      root >>= 1;
+    bit >>= 2;
+  }
+  return root;
+}
+
+#endif // _FIXEDPOINT_H_
@@ -5,6 +5,8 @@
 #include "Temperature.h"
 #include "SDCard.h"
 #include "Eeprom.h"
+#include "IsrProfile.h"
+#include "StepTrace.h"
 #include <avr/pgmspace.h>
 #include "ArduinoMap.h"
 #ifndef USE_MARLIN
@@ -24,6 +26,91 @@ extern LCDKeypad LCDKEYPAD;
 #define SETOBJ(x) MOTION.x
 #endif
 
+const char gcode_param_letters[] PROGMEM = "XYZEMGFPSIJKRT";
+
+bool CodeParams::claim(char letter, bool asint)
+{
+	uint32_t b = bit(letter);
+	if(!(present & b))
+	{
+		uint8_t n = slot(26);
+		if(n == GCODE_MAX_PARAMS)
+			return false;
+		uint8_t at = slot(letter - 'A');
+		for(uint8_t x=n;x>at;x--)
+			values[x] = values[x-1];
+		present |= b;
+	}
+	if(asint)
+		isint |= b;
+	else
+		isint &= ~b;
+	return true;
+}
+
+void CodeParams::dump_to_host()
+{
+	for(char l='A';l<='Z';l++)
+	{
+		if(present & bit(l))
+			CodeParam(*this, l).dump_to_host();
+	}
+}
+
+void CodeParam::unset()
+{
+	if(isUnused())
+		return;
+	uint8_t at = params.slot(letter - 'A');
+	uint8_t n = params.slot(26);
+	for(uint8_t x=at;x+1<n;x++)
+		params.values[x] = params.values[x+1];
+	params.present &= ~CodeParams::bit(letter);
+}
+
+bool CodeParam::setFloat(float v)
+{
+	if(!params.claim(letter, false))
+		return false;
+	params.values[params.slot(letter - 'A')].f = v;
+	return true;
+}
+
+bool CodeParam::setInt(unsigned long v)
+{
+	if(!params.claim(letter, true))
+		return false;
+	params.values[params.slot(letter - 'A')].u = v;
+	return true;
+}
+
+float CodeParam::getFloat()
+{
+	return isUnused() ? 0 : params.values[params.slot(letter - 'A')].f;
+}
+
+long CodeParam::getInt()
+{
+	return isUnused() ? 0 : params.values[params.slot(letter - 'A')].u;
+}
+
+bool CodeParam::isUnused()
+{
+	return !(params.present & CodeParams::bit(letter));
+}
+
+void CodeParam::dump_to_host()
+{
+	HOST.write(letter); HOST.write(':');
+	if(isUnused())
+		HOST.write('U');
+	else if(params.isint & CodeParams::bit(letter))
+		HOST.write(getInt(),10);
+	else
+		HOST.write(getFloat(), 10,5);
+	HOST.write(' ');
+}
+
 Point GCode::lastpos;
 float GCode::lastfeed;
 Pin   GCode::fanpin = Pin();
@@ -51,25 +138,8 @@ void GCode::prepare()
 		cps[E].unset();
 	}
 
-	// Only GCodes need preparing.
-	if(cps[G].isUnused())
-		state = PREPARED;
-	else
-		MOTION.gcode_precalc(*this,lastfeed,&lastpos);
-#endif
-}
-
-// Called when we have extra time to optimize a gcode.
-void GCode::optimize(GCode& next)
-{
-#ifndef USE_MARLIN
-	if(state != PREPARED)
-		return;
-
-	if(next.state != PREPARED)
-		return;
-
-	MOTION.gcode_optimize(*this, next);
+	// Moves are worked out when they're handed to the move queue, in execute().
+	state = PREPARED;
 #endif
 }
 
@@ -83,6 +153,7 @@ void GCode::enqueue()
 			case 0:
 			case 1:
 			case 2:
+			case 3:
 				for(int ax=0;ax<NUM_AXES;ax++)
 				{
 					if(!cps[ax].isUnused())
@@ -92,9 +163,18 @@ void GCode::enqueue()
 							float foo = lastpos[ax] + cps[ax].getFloat();
 							cps[ax].setFloat(foo);
 						}
+						if(cps[G].getInt() != 0)
+							lastpos[ax] = cps[ax].getFloat();
 					}
 				}
 				break;
+			case 92:
+				for(int ax=0;ax<NUM_AXES;ax++)
+				{
+					if(!cps[ax].isUnused())
+						lastpos[ax] = cps[ax].getFloat();
+				}
+				break;
 			case 90:  // Set Absolute Positioning
 				ISRELATIVE = false;
 				break;
@@ -103,16 +183,13 @@ void GCode::enqueue()
 				break;
 		}
 	}
-	prepare(); // Need to prepare at this point so that we have the correct lastpos
+	prepare();
 }
 
 // Do some stuff and return.  This function will be called repeatedly while
 // the state is still ACTIVE, and you can set up an interrupt for precise timings.
 void GCode::execute()
 {
-	if(startmillis == 0)
-		startmillis = millis();
-
 	if(state < PREPARED)
 	{
 		prepare();
@@ -123,6 +200,15 @@ void GCode::execute()
 		return;
 	}
 
+#ifndef USE_MARLIN
+	// Moves go on the move queue; everything else waits for it to run dry.
+	if(!isMove() && !MOTION.isBufferEmpty())
+		return;
+#endif
+
+	if(startmillis == 0)
+		startmillis = millis();
+
 
 	if(cps[G].isUnused())
 	{
@@ -137,8 +223,7 @@ void GCode::execute()
 void GCode::dump_to_host()
 {
 	HOST.labelnum("L:", linenum);
-	for(int x=0;x<T;x++)
-		cps[x].dump_to_host();
+	cps.dump_to_host();
 	HOST.endl();
 }
 
@@ -147,9 +232,6 @@ void GCode::wrapupmove()
 #ifndef USE_MARLIN
 	if(!cps[G].isUnused())
 	{
-#ifdef DEBUG_MOVE
-		dump_movedata();
-#endif
 #ifndef REPRAP_COMPAT
 		Host::Instance(source).labelnum("done ", linenum, false); Host::Instance(source).labelnum(" G", cps[G].getInt());
 #endif
@@ -177,9 +259,19 @@ void GCode::do_g_code()
 			if(Marlin::add_buffer_line(*this))
 				state = DONE;
 #else
-			MOTION.gcode_execute(*this);
+			if(MOTION.gcode_precalc(*this, lastfeed))
+				state = DONE;
 #endif
 			break;
+#ifndef USE_MARLIN
+		case 2: // Clockwise arc
+		case 3: // Counter-clockwise arc
+			// Cut into chords as the move queue has room, so this stays at the
+			// front of the gcode queue until the last one is queued.
+			if(MOTION.gcode_arc(*this, lastfeed))
+				state = DONE;
+			break;
+#endif
 		case 4: // Pause for P millis
 			if(millis() - cps[P].getInt() > startmillis)
 			{
@@ -188,6 +280,14 @@ void GCode::do_g_code()
 			else
 				state = ACTIVE;
 			break;
+#ifndef USE_MARLIN
+		case 17: // Arcs in the XY plane
+		case 18: // Arcs in the ZX plane
+		case 19: // Arcs in the YZ plane
+			MOTION.setArcPlane(cps[G].getInt() - 17);
+			state = DONE;
+			break;
+#endif
 		case 21: // Units are mm
 			state = DONE;
 			break;
@@ -226,6 +326,36 @@ void GCode::write_temps_to_host(int port)
 #endif
 }
 
+void GCode::do_realtime()
+{
+	switch(cps[M].getInt())
+	{
+		case 112: // Emergency stop: motion, queue, heaters and SD print, right now
+#ifndef USE_MARLIN
+			MOTION.emergencyStop();
+			lastpos = MOTION.getCurrentPosition();
+#endif
+			GCODES.flush();
+			TEMPERATURE.setHotend(0);
+			TEMPERATURE.setPlatform(0);
+#ifdef HAS_SD
+			sdcard::pause();
+#endif
+			Host::Instance(source).rxerror("EMERGENCY STOP");
+			break;
+		case 222: // NOT STANDARD - feed override, S in percent (M220 elsewhere; ours sets endstops)
+#ifndef USE_MARLIN
+			if(!cps[S].isUnused())
+				MOTION.setFeedModifier(cps[S].getInt());
+#endif
+			break;
+		case 226: // NOT STANDARD - pause before the next move; P0 to resume
+			GCODES.setPause(cps[P].isUnused() || cps[P].getInt() != 0);
+			break;
+	}
+	state = DONE;
+}
+
 void GCode::do_m_code()
 {
 #ifdef USE_MARLIN
@@ -507,10 +637,42 @@ void GCode::do_m_code()
       state = DONE;
       break;
 #endif
+#ifndef USE_MARLIN
+		case 209: // NOT STANDARD - set lookahead junction deviation, P in microns; P0 to corner by start feeds
+			if(!cps[P].isUnused())
+				MOTION.setJunctionDeviation(cps[P].getInt() / 1000.0f);
+			state = DONE;
+			break;
+		case 210: // NOT STANDARD - P1 for S-curve acceleration, P0 for trapezoids
+			MOTION.setSCurve(!cps[P].isUnused() && cps[P].getInt() == 1);
+			state = DONE;
+			break;
+		case 212: // NOT STANDARD - set arc chord tolerance, P in microns
+			if(!cps[P].isUnused())
+				MOTION.setArcTolerance(cps[P].getInt() / 1000.0f);
+			state = DONE;
+			break;
+#ifdef MERGE_TOLERANCE
+		case 213: // NOT STANDARD - set collinear move merging tolerance, P in microns; P0 to merge nothing
+			if(!cps[P].isUnused())
+				GCODES.setMergeTolerance(cps[P].getInt() / 1000.0f);
+			state = DONE;
+			break;
+#endif
+#ifdef LINEAR_ADVANCE_K
+		case 900: // Linear advance, K in seconds as Marlin has it; K0 to turn it off
+			if(!cps[K].isUnused())
+				MOTION.setLinearAdvance(cps[K].getFloat());
+			state = DONE;
+			break;
+#endif
+#endif
+#ifndef FIXED_STEP_PINS
 		case 300: // NOT STANDARD - set axis STEP pin
 			SETOBJ(setStepPins(*this));
 			state = DONE;
 			break;
+#endif
 		case 301: // NOT STANDARD - set axis DIR pin
 			SETOBJ(setDirPins(*this));
 			state = DONE;
@@ -519,6 +681,15 @@ void GCode::do_m_code()
 			SETOBJ(setEnablePins(*this));
 			state = DONE;
 			break;
+#ifdef FIXED_STEP_PINS
+		case 300:
+		case 304:
+		case 305: // The step interrupt uses the step and endstop pins the board config names.
+			Host::Instance(source).labelnum("warn ", linenum, false);
+			Host::Instance(source).write_P(PSTR(" MCODE ")); Host::Instance(source).write(cps[M].getInt(), 10); Host::Instance(source).write_P(PSTR(" IGNORED, FIXED_STEP_PINS\n"));
+			state = DONE;
+			break;
+#else
 		case 304: // NOT STANDARD - set axis MIN pin
 			SETOBJ(setMinPins(*this));
 			state = DONE;
@@ -527,6 +698,7 @@ void GCode::do_m_code()
 			SETOBJ(setMaxPins(*this));
 			state = DONE;
 			break;
+#endif
 		case 307: // NOT STANDARD - set axis invert
 			SETOBJ(setAxisInvert(*this));
 			state = DONE;
@@ -543,6 +715,34 @@ void GCode::do_m_code()
 			SETOBJ(reportConfigStatus(Host::Instance(source)));
 			state = DONE;
 			break;
+#ifdef ISR_PROFILE
+		case 311: // NOT STANDARD - report interrupt cycle counts; P1 to clear them after
+			isrprofile::report(Host::Instance(source));
+			if(!cps[P].isUnused() && cps[P].getInt() == 1)
+				isrprofile::reset();
+			state = DONE;
+			break;
+#endif
+#ifdef STEP_TRACE
+		case 312: // NOT STANDARD - dump the step trace, in binary; see util/steptrace.pl
+			steptrace::dump(Host::Instance(source));
+			state = DONE;
+			break;
+#endif
+#ifndef USE_MARLIN
+		case 313: // NOT STANDARD - report how often the steppers ran short of moves; P1 to clear after
+			GCODES.reportStarved(Host::Instance(source));
+			if(!cps[P].isUnused() && cps[P].getInt() == 1)
+				GCODES.clearStarved();
+			state = DONE;
+			break;
+#endif
+		case 321: // NOT STANDARD - binary packets; P0 back to text.  Switched as it's parsed, in GcodeQueue
+			state = DONE;
+			break;
+		case 322: // NOT STANDARD - P1 to have oks report free queue slots and receive buffer; switched in GcodeQueue too
+			state = DONE;
+			break;
 		case 350: // NOT STANDARD - change gcode optimization
 			if(!cps[P].isUnused() && cps[P].getInt() == 1)
 				GCODES.enableOptimize();
@@ -595,14 +795,6 @@ void GCode::do_m_code()
 #endif
 }
 
-void GCode::resetlastpos()
-{
-#ifndef USE_MARLIN
-	lastpos = MOTION.getCurrentPosition();
-#endif
-	// TODO?
-}
-
 void GCode::doPinSet(int arduinopin, int on)
 {
 	Pin p = Pin(ArduinoMap::getPort(arduinopin),  ArduinoMap::getPinnum(arduinopin));
@@ -15,49 +15,75 @@
 #include "Point.h"
 #include "Time.h"
 #include "AvrPort.h"
+#include <avr/pgmspace.h>
 
 
-// CodeParameter; basically a fancy union/variable datatype.
+// Letters for the Globals.h param names, in order.
+extern const char gcode_param_letters[] PROGMEM;
+
+class CodeParams;
+
+// One parameter of a GCode, looked up by letter; see CodeParams.  Handed out
+// by value, so hang on to the GCode rather than this.
 class CodeParam
 {
 public:
-  enum states_T { UNUSED, FLOAT, INT } state;
-  CodeParam(const char name) :state(UNUSED), letter(name) { };
-
-  void unset() { state = UNUSED; u=0; }
-  void setFloat(float v) { f = v; state = FLOAT; }
-  void setInt(unsigned long v) { u = v; state = INT; }
-  void setFloat(const char* v) { f = atof(v); state = FLOAT; }
-  void setInt(const char* v) { u = atol(v); state = INT; }
-  float& getFloat() { return f; }
-  long& getInt() { return u; }
-  bool isUnused() { return state == UNUSED; }
-
-  void dump_to_host() 
-  { 
-    HOST.write(letter); HOST.write(':');
-    switch(state)
-    {
-      case UNUSED:
-        HOST.write('U');
-        break;
-      case FLOAT:
-        HOST.write(f, 10,5);
-        break;
-      case INT:
-        HOST.write(u,10);
-        break;
-    }
-    HOST.write(' ');
-  }
+  CodeParam(CodeParams& p, char name) :params(p), letter(name) { };
+
+  void unset();
+  // False if the code already has GCODE_MAX_PARAMS other letters.
+  bool setFloat(float v);
+  bool setInt(unsigned long v);
+  float getFloat();
+  long getInt();
+  bool isUnused();
+  void dump_to_host();
 
-  
+private:
+  CodeParams& params;
   char letter;
-  union 
+};
+
+// A GCode's parameters: which of A-Z it has, and the values of those alone,
+// packed in letter order.  Any letter can be used, and a queued code is far
+// smaller than it would be with a slot for every letter.
+class CodeParams
+{
+public:
+  // Globals.h name (X, Y, ... T), or a letter 'A'-'Z'
+  CodeParam operator[](int idx)
+  {
+    return CodeParam(*this, idx < 'A' ? pgm_read_byte(&gcode_param_letters[idx]) : idx);
+  }
+  void clear() { present = 0; }
+  uint8_t getFree() { return GCODE_MAX_PARAMS - slot(26); }
+  void dump_to_host();
+
+private:
+  friend class CodeParam;
+  uint32_t present; // bit per letter, A first
+  uint32_t isint;
+  union
   {
     float f;
     long u;
-  };
+  } values[GCODE_MAX_PARAMS];
+
+  static uint32_t bit(char letter) { return 1UL << (letter - 'A'); }
+  // Where a letter's value is (or would go) in values[].
+  uint8_t slot(uint8_t index)
+  {
+    uint32_t below = present & ((1UL << index) - 1);
+    uint8_t n = 0;
+    while(below)
+    {
+      below &= below - 1;
+      n++;
+    }
+    return n;
+  }
+  // Makes room for a letter if need be; false if there's none.
+  bool claim(char letter, bool asint);
 };
 
 // It would be a swell plan to make this class a polymorphic hierarchy and pop pointers to base
@@ -66,10 +92,8 @@ public:
 class GCode
 {
 public:
-  GCode(): cps((CodeParam[10]){  CodeParam('X'), CodeParam('Y'), CodeParam('Z'), CodeParam('E'),
-                                  CodeParam('M'), CodeParam('G'), CodeParam('F'), CodeParam('P'),
-                                  CodeParam('S'), CodeParam('T') }) { reset(); };
-  CodeParam& operator[](int idx) { return cps[idx]; }
+  GCode() { reset(); };
+  CodeParam operator[](int idx) { return cps[idx]; }
   enum mg_states_t { NEW, PREPARED, ACTIVE, DONE };
   volatile mg_states_t state;
   int32_t  linenum;
@@ -77,36 +101,14 @@ public:
 
   void reset()
   {
-    for(int x=0;x<T;x++)
-    {
-      cps[x].unset();
-#ifndef USE_MARLIN      
-      if(x<=E)
-      {
-        axismovesteps[x] = 0;
-        axisdirs[x] = false;
-      }
-#endif
-    }
-    
+    cps.clear();
+
     state = NEW;
     lastms = 0;
     linenum = -1;
     feed=0;
-
-#ifndef USE_MARLIN      
-    movesteps=0;
-    leading_axis=0;
-
-    currentinterval=0;
-    accel_until=0;
-    decel_from=0;
-    accel_inc=0;
-#endif // USE_MARLIN      
   }
 
-  static void resetlastpos();
-
   // This gets called at the time the gcode is created; there's some codes (G91, for eg) that are critical
   // to handle at this stage.
   void enqueue();
@@ -114,44 +116,30 @@ public:
   // This function MAY get called repeatedly before the execute() function.
   // it WILL be called at least once.
   void prepare();
-  // This function optimizes chained moves to only slow down as required.
-  // It is only performed when the gcodes are already prepared.
-  void optimize(GCode& next);
   // Do some stuff and return.  This function will be called repeatedly while 
   // the state is still ACTIVE, and you can set up an interrupt for precise timings.
   void execute();
   bool isDone() { return (state == DONE); };
+  // Letters that hold a whole number; the rest are floats, bar X-E for M300 and up.
+  static bool isIntParam(char letter) { return letter == 'D' || letter == 'G' || letter == 'H' || letter == 'L' || letter == 'M' || letter == 'P' || letter == 'S' || letter == 'T'; }
+  uint8_t paramsFree() { return cps.getFree(); }
+  bool isMove() { return !cps[G].isUnused() && cps[G].getInt() >= 0 && cps[G].getInt() <= 3; }
   void dump_to_host();
   // Called when move is completed (no good place to do it. :( )
   void wrapupmove();
 
   void setLinenumber(int32_t num) { linenum = num; };
+  int32_t getLinenumber() { return linenum; }
 
-#ifndef USE_MARLIN
-  void dump_movedata()
-  {
-#ifdef DEBUG_MOVE  
-    HOST.labelnum("L:",linenum,false);
-    HOST.labelnum(" T:",(millis() - startmillis),false);
-    HOST.labelnum(" F:",feed,false);
-    HOST.labelnum(" Steps:",axismovesteps[leading_axis],false);
-    HOST.labelnum(" Lead:",leading_axis,false);
-    HOST.labelnum(" CurI:",currentinterval,false);
-    HOST.labelnum(" CurF:",currentfeed,false);
-    HOST.labelnum(" StartF:",startfeed,false);
-    HOST.labelnum(" MaxF:",maxfeed,false);
-    HOST.labelnum(" EndF:",endfeed,false);
-    HOST.labelnum(" AUnt:",accel_until,false);
-    HOST.labelnum(" DFrom:",decel_from,false);
-    HOST.labelnum(" AInc:",accel_inc,true);
-#endif    
-  }
-#endif
+  // Codes the GcodeQueue runs the moment they're parsed, ahead of everything
+  // queued and without taking a slot; they mustn't wait on anything.
+  static bool isRealtime(long m) { return m == 112 || m == 222 || m == 226; }
+  void do_realtime();
 
   static Point& getLastpos() { return lastpos; }
 
 private:
-  CodeParam cps[T+1];                    
+  CodeParams cps;
   unsigned long lastms;
   unsigned long startmillis; // Time execution began
   static Point lastpos;
@@ -176,36 +164,6 @@ public:
   // all good
   float feed;
   int source;
-
-#ifndef USE_MARLIN
-  // This was separated out, maybe will be again...
-  // preparsed data specific to G1 type moves.
-  uint32_t movesteps;
-  uint32_t axismovesteps[NUM_AXES];
-  bool     axisdirs[NUM_AXES];
-  int      leading_axis;
-  bool     optimized;
-
-  float actualmm;
-  float axisratio[NUM_AXES];
-  
-  uint32_t currentinterval;
-  uint32_t startfeed;
-  uint32_t maxfeed;
-  uint32_t endfeed;
-  uint32_t currentfeed;
-  uint32_t minfeed;
-
-  uint32_t accel_until;
-  uint32_t decel_from;
-  float    accel;
-  uint32_t accel_inc;
-  uint32_t accel_timer;
-
-  Point    endpos;
-  Point    startpos;
-#endif  
-
 };
 
 
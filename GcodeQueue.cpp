@@ -3,6 +3,7 @@
 #include "Host.h"
 #include "Globals.h"
 #include <stdlib.h>
+#include <math.h>
 #include <errno.h>
 #include <avr/pgmspace.h>
 #include "Motion.h"
@@ -13,6 +14,68 @@
 #include "SDCard.h"
 
 
+// Powers of ten, all exact as floats.
+static const uint32_t decimal_scale[] PROGMEM = {
+	1UL, 10UL, 100UL, 1000UL, 10000UL, 100000UL,
+	1000000UL, 10000000UL, 100000000UL, 1000000000UL
+};
+
+// Takes a parameter's number a byte at a time as parsebytes goes past it, so
+// it needn't go back over the fragment with atof/atol.  The digits are kept as
+// an integer and the decimal point put back with one divide, which gives the
+// nearest float as long as the digits fit in 24 bits.  Longer numbers fall
+// back on the library.
+class DecimalParser
+{
+public:
+	DecimalParser() : digits(0), places(0), neg(false), point(false), done(false), overflow(false), any(false) {}
+
+	void add(char b)
+	{
+		if(done)
+			return;
+		if(b >= '0' && b <= '9')
+		{
+			if(digits > 214748363UL || (point && places == 9))
+				overflow = true;
+			else
+			{
+				digits = digits * 10 + (b - '0');
+				if(point)
+					places++;
+			}
+			any = true;
+		}
+		else if(b == '.' && !point)
+			point = true;
+		else if((b == '-' || b == '+') && !any && !point && !neg)
+			neg = b == '-';
+		else
+			done = true;
+	}
+	void finish() { done = true; }
+
+	long toInt(const char* text)
+	{
+		if(overflow)
+			return atol(text);
+		long v = places ? digits / pgm_read_dword(&decimal_scale[places]) : digits;
+		return neg ? -v : v;
+	}
+	float toFloat(const char* text)
+	{
+		if(overflow || digits > 0xFFFFFFUL)
+			return atof(text);
+		float v = places ? (float)digits / (float)pgm_read_dword(&decimal_scale[places]) : (float)digits;
+		return neg ? -v : v;
+	}
+
+private:
+	uint32_t digits;
+	uint8_t  places;
+	bool neg, point, done, overflow, any;
+};
+
 
 // TODO: Why is this here?
 void GcodeQueue::checkaxes()
@@ -25,132 +88,213 @@ void GcodeQueue::checkaxes()
 	{
 		//HOST.write("checkaxes ");
 		last = now;
-		bool axesseen[NUM_AXES] = { false };
-		for(int x=0;x<codes.getCount();x++)
-		{
-			for(int ax = 0; ax<NUM_AXES; ax++)
-			{
-				if(codes.peek(x).axismovesteps[ax] != 0)
-					axesseen[ax] = true;
-			}
-		}
-#ifdef USE_PRIORITY
-		for(int x=0;x<prority_codes.getCount();x++)
-		{
-			for(int ax = 0; ax<NUM_AXES; ax++)
-			{
-				if(priority_codes.peek(x).axismovesteps[ax] != 0)
-					axesseen[ax] = true;
-			}
-		}
-#endif
 		for(int ax = 0; ax<NUM_AXES; ax++)
 		{
 			//HOST.labelnum("ax:",ax, false);
-			//HOST.labelnum(":", axesseen[ax], false);
+			//HOST.labelnum(":", MOTION.isAxisQueued(ax), false);
 			//HOST.write(' ');
-			if(!axesseen[ax]) MOTION.disableAxis(ax);
+			if(!MOTION.isAxisQueued(ax)) MOTION.disableAxis(ax);
 		}
 		//HOST.endl();
 	}
 #endif
 }
 
+// Runs the codes at the front of the queue.  Moves go straight on to the move
+// queue, so several can be taken in one go: as many as there's time for
+// before the steppers run out of planned moves (see PLAN_BUDGET), and then the
+// moves are replanned once, if there's time left.  Otherwise that waits for
+// the next call; what's already planned is safe to run as it is.
 void GcodeQueue::handlenext()
 {
-	static unsigned int loops = 0;
+#ifndef USE_MARLIN
+	// Moves run off their own queue once they leave this one.
+	MOTION.handlenext();
 
-	if(codes.getCount() == 0)
-	{
-		return;
-	}
+	unsigned long start = micros();
+	uint32_t budget = MOTION.queuedTime(PLAN_BUDGET + PLAN_MARGIN);
+	budget = budget > PLAN_MARGIN ? budget - PLAN_MARGIN : 0;
 
-	if(codes.peek(0).isDone())
-	{
-		codes.peek(0).wrapupmove();
-		codes.pop();
-		//HOST.labelnum("RC-QL:", codes.getCount());
-		loops = 0;
-		if(codes.isEmpty())
-			return;
-	}
+	checkstarved();
+#endif
 
-	// Oops, something went wrong
-	if(invalidate_codes)
+	while(!codes.isEmpty())
 	{
-		for(unsigned int x=0;x<codes.getCount();x++)
-			codes.peek(x).state = GCode::NEW;
+		if(codes.peek(0).isDone())
+		{
+			codes.peek(0).wrapupmove();
+			codes.pop();
+			//HOST.labelnum("RC-QL:", codes.getCount());
+			continue;
+		}
 
-		GCode::resetlastpos();
-		HOST.write_P(PSTR("\nINVALIDATED CODES\n"));
-		invalidate_codes = false;
-		return;
-	}
+		if(pause)
+			break;
 
+		GCode& c = codes.peek(0);
+		c.execute();
+		if(!c.isDone())
+			break;
+		after_move = c.isMove();
 
-#ifdef USE_PRIORITY
-	if(!priority_codes.isEmpty())
+#ifdef USE_MARLIN
+		break;
+#else
+		if(micros() - start >= budget)
+			break;
+#endif
+	}
+
+#ifndef USE_MARLIN
+	// With the steppers stopped nothing is waiting on the plan.  With them
+	// running and no time left, the replan waits, since the moves that would
+	// run meanwhile are safe as planned.  It mustn't wait for ever, though: on
+	// a queue that never gets ahead (a slow host) the moves would stop at every
+	// joint.  So after PLAN_DEFERRALS passes in a row it goes ahead anyway.
+	if(MOTION.needsPlan())
 	{
-		priority_codes.peek(0).execute();
+		if(!MOTION.axesAreMoving() || micros() - start < budget || deferrals >= PLAN_DEFERRALS)
+		{
+			MOTION.planQueued();
+			deferrals = 0;
+		}
+		else
+		{
+			deferred++;
+			deferrals++;
+		}
 	}
-	else
 #endif
-	if(codes.isEmpty() || pause)
-		return;
+}
 
-	codes.peek(0).execute();
+#ifndef USE_MARLIN
+// The steppers are idle while a move waits here, and the code before it was a
+// move too, so it isn't just a code that has to wait for them to stop.
+void GcodeQueue::checkstarved()
+{
+	bool now = after_move && !pause && MOTION.isBufferEmpty() &&
+		!codes.isEmpty() && codes.peek(0).isMove();
 
-	// If we just executed the code in front for the first time, then we just return.
-	// If it's had some time to go, then we start preparing the next, and the one after, etc.
-	unsigned int codesinqueue = codes.getCount();
-	unsigned int less = loops < codesinqueue ? loops : codesinqueue;
-	for(unsigned int x=1;x<less;x++)
+	if(now && !starving)
 	{
-		codes.peek(x).prepare();
-		if(optimize_gcode)
-		{
-			if(x+1 < less && codes.peek(x+1).state == GCode::PREPARED)
-			{
-				codes.peek(x).optimize(codes.peek(x+1));
-			}
-		}
+		starved++;
+		starve_since = millis();
 	}
-	++loops;
+	else if(!now && starving)
+		starved_ms += millis() - starve_since;
+	starving = now;
+}
+
+void GcodeQueue::reportStarved(Host& h)
+{
+	h.labelnum("starved: ", starved, false);
+	h.labelnum(" ms: ", starved_ms, false);
+	h.labelnum(" underruns: ", MOTION.getUnderruns(), false);
+	h.labelnum(" deferred: ", deferred, true);
+}
+
+void GcodeQueue::clearStarved()
+{
+	starved = 0;
+	starved_ms = 0;
+	deferred = 0;
+	MOTION.clearUnderruns();
 }
+#endif
 
 void GcodeQueue::setLineNumber(uint32_t l, uint8_t source) { line_number[source] = l - 1; }
 
-void GcodeQueue::enqueue(GCode &c,int queue)
+void GcodeQueue::enqueue(GCode &c)
 {
 	if(c[M].isUnused() == c[G].isUnused()) // Both used or both unused is an error.
 		return;
 
+#ifdef MERGE_TOLERANCE
+	Point from = GCode::getLastpos();
+#endif
 	c.enqueue(); // Allows the code to do something at enqueue time.
 
-	if(queue == 0)
-	{
-		codes.push(c);
-		//HOST.labelnum("AC-QL:", codes.getCount());
-	}
-
-#ifdef USE_PRIORITY
-	else if(queue == 1)
-	{
-		priority_codes.push(c);
-	}
+#ifdef MERGE_TOLERANCE
+	if(merge(c, from))
+		return;
 #endif
-	// TODO: else die with an error?
+	codes.push(c);
+	//HOST.labelnum("AC-QL:", codes.getCount());
 }
 
-bool GcodeQueue::isFull(int queue)
+#ifdef MERGE_TOLERANCE
+// If the G1 just enqueued (from -> lastpos) carries straight on from the G1
+// queued before it, and that one isn't on the move queue yet, stretch that one
+// to end where this does instead of queueing this.  The points merged away
+// are kept within merge_tolerance of the line: each merge can't shift the
+// line, anywhere along what's already merged, by more than the new joint is
+// off it, so adding that up bounds all of them.  E is held to the same
+// tolerance against a constant extrusion rate.
+bool GcodeQueue::merge(GCode& c, Point& from)
 {
-#ifdef USE_PRIORITY
-	if(queue == 1)
-		return priority_codes.isFull();
-#endif
+	bool line = c[M].isUnused() && c[G].getInt() == 1 &&
+		c[P].isUnused() && c[S].isUnused() && c[T].isUnused();
+	Point& to = GCode::getLastpos();
+
+	if(line && merge_ok && merge_tolerance > 0 && !codes.isEmpty())
+	{
+		GCode& last = codes.peek(codes.getCount() - 1);
+		uint8_t need = 0;
+		for(int ax=0;ax<NUM_AXES;ax++)
+		{
+			if(!c[ax].isUnused() && last[ax].isUnused())
+				need++;
+		}
+		if(last.state == GCode::PREPARED && !last[G].isUnused() && last[G].getInt() == 1 && last.paramsFree() >= need &&
+			(c[F].isUnused() || (!last[F].isUnused() && last[F].getFloat() == c[F].getFloat())))
+		{
+			float a[3], b[3];
+			float la = 0, lb = 0, dot = 0;
+			for(int ax=X;ax<=Z;ax++)
+			{
+				a[ax] = from[ax] - merge_start[ax];
+				b[ax] = to[ax] - from[ax];
+				la += a[ax] * a[ax];
+				lb += b[ax] * b[ax];
+				dot += a[ax] * b[ax];
+			}
+			la = sqrt(la);
+			lb = sqrt(lb);
 
-	return codes.isFull();
+			if(la > 0 && lb > 0 && dot > 0)
+			{
+				// How far the joint is off the merged line, in space and in E.
+				float cx = a[Y] * b[Z] - a[Z] * b[Y];
+				float cy = a[Z] * b[X] - a[X] * b[Z];
+				float cz = a[X] * b[Y] - a[Y] * b[X];
+				float sx = a[X] + b[X], sy = a[Y] + b[Y], sz = a[Z] + b[Z];
+				float dev = sqrt((cx*cx + cy*cy + cz*cz) / (sx*sx + sy*sy + sz*sz));
+				float ea = from[E] - merge_start[E];
+				float eb = to[E] - from[E];
+				float edev = fabs(ea * lb - eb * la) / (la + lb);
+
+				if(merge_dev + dev <= merge_tolerance && merge_edev + edev <= merge_tolerance)
+				{
+					merge_dev += dev;
+					merge_edev += edev;
+					for(int ax=0;ax<NUM_AXES;ax++)
+					{
+						if(!c[ax].isUnused())
+							last[ax].setFloat(to[ax]);
+					}
+					return true;
+				}
+			}
+		}
+	}
+
+	merge_ok = line;
+	merge_start = from;
+	merge_dev = 0;
+	merge_edev = 0;
+	return false;
 }
+#endif
 
 void GcodeQueue::parsebytes(char *bytes, uint8_t numbytes, uint8_t source)
 {
@@ -164,40 +308,53 @@ void GcodeQueue::parsebytes(char *bytes, uint8_t numbytes, uint8_t source)
 	if(crc_state[source] == NOCRC && bytes[0] == 'N')
 		crc_state[source] = CRC;
 
-	if(crc_state[source] == CRC)
+	// One pass over the fragment does the checksum, the number after the letter
+	// and the checksum the host sent after '*', all as the bytes go by.
+	const bool withcrc = crc_state[source] == CRC;
+	bool checking = withcrc;
+	bool incrc = false;
+	DecimalParser num;
+	for(uint8_t x=0;x<=numbytes;x++)
 	{
-		uint8_t crcpos=0;
-		for(int x=0;x<=numbytes;x++)
+		char b = bytes[x];
+		if(incrc)
 		{
-			if(bytes[x] == '*')
+			if(b >= '0' && b <= '9')
+				ourcrc = ourcrc * 10 + (b - '0');
+			else
+				incrc = false;
+			continue;
+		}
+
+		if(checking)
+		{
+			if(b == '*')
 			{
 				bytes[x] = 0;
-				crcpos=x+1;
+				incrc = true;
+				checking = false;
+				packetdone = true;
 				crc_state[source] = CRCCOMPLETE;
 				if(ADVANCED_CRC[source])
 					crc[source] += chars_in_line[source] + x + 128;
-				break;
+				num.finish();
+				continue;
 			}
 
-			crc[source] ^= bytes[x];
+			crc[source] ^= b;
 
-			if(bytes[x] < 32)
+			if(b < 32)
 			{
 				bytes[x] = 0;
 				packetdone = true;
 			}
 		}
 
-		// CRC finished?
-		// If crcpos == 0 then no crcpos.
-		// If crcpos == 1 then it will be handled in following switch.
-		if(crcpos >= 1)
-		{
-			ourcrc = atoi(bytes + crcpos);
-			packetdone = true;
-		}
+		if(x > 0)
+			num.add(b);
 	}
-	else if(bytes[numbytes] < 32)
+
+	if(!withcrc && bytes[numbytes] < 32)
 		packetdone = true;
 
 	chars_in_line[source] += numbytes+1;
@@ -214,7 +371,6 @@ void GcodeQueue::parsebytes(char *bytes, uint8_t numbytes, uint8_t source)
 		c.reset();
 
 	long l;
-	errno = 0;
 
 	// bytes should contain the filename
 	if (m23filename) {
@@ -232,11 +388,11 @@ void GcodeQueue::parsebytes(char *bytes, uint8_t numbytes, uint8_t source)
 			Host::Instance(source).endl();
 		}
 	}
-	else {
+	else if(bytes[0] == 'N' || isparam(c, bytes, source)) {
 		switch(bytes[0])
 		{
 			case 'N':
-				l = atol(bytes+1);
+				l = num.toInt(bytes+1);
 				//HOST.labelnum("Starting line number:", (int) line_number + 1, true);
 				// TODO: fixme; allow start with '1' to fix dumb hosts.
 				if(l < 1)
@@ -272,7 +428,7 @@ void GcodeQueue::parsebytes(char *bytes, uint8_t numbytes, uint8_t source)
 				break;
 			case 'M':
 				// EEPROM write begin must start immediately so we do not miss whatever may come in
-				c[M].setInt(bytes+1);
+				c[M].setInt(num.toInt(bytes+1));
 				switch(c[M].getInt()) {
 #ifdef HAS_SD
 					case 20: // M20 - list SD card files
@@ -364,50 +520,20 @@ void GcodeQueue::parsebytes(char *bytes, uint8_t numbytes, uint8_t source)
 						break;
 					}
 				break;
-			case 'G':
-				c[G].setInt(bytes+1);
-				break;
-			case 'F':
-				c[F].setFloat(bytes+1);
-				break;
 			case 'X':
-				if((!c[M].isUnused()) && (c[M].getInt() >= 300))
-					c[X].setInt(bytes+1);
-				else
-					c[X].setFloat(bytes+1);
-				break;
 			case 'Y':
-				if((!c[M].isUnused()) && (c[M].getInt() >= 300))
-					c[Y].setInt(bytes+1);
-				else
-					c[Y].setFloat(bytes+1);
-				break;
 			case 'Z':
-				if((!c[M].isUnused()) && (c[M].getInt() >= 300))
-					c[Z].setInt(bytes+1);
-				else
-					c[Z].setFloat(bytes+1);
-				break;
 			case 'E':
 				if((!c[M].isUnused()) && (c[M].getInt() >= 300))
-					c[E].setInt(bytes+1);
+					c[bytes[0]].setInt(num.toInt(bytes+1));
 				else
-					c[E].setFloat(bytes+1);
-				break;
-			case 'P':
-				c[P].setInt(bytes+1);
-				break;
-			case 'S':
-				c[S].setInt(bytes+1);
-				break;
-			case 'T':
-				//c[T].setInt(bytes+1);
-				break;
-			case 0:
-				; // noise
+					c[bytes[0]].setFloat(num.toFloat(bytes+1));
 				break;
 			default:
-				; // just noise
+				if(GCode::isIntParam(bytes[0]))
+					c[bytes[0]].setInt(num.toInt(bytes+1));
+				else
+					c[bytes[0]].setFloat(num.toFloat(bytes+1));
 				break;
 		}
 	} // if (m23filename) .. else
@@ -416,6 +542,8 @@ void GcodeQueue::parsebytes(char *bytes, uint8_t numbytes, uint8_t source)
 	{
 		//HOST.write("Packet parsed.\n");
 		//HOST.labelnum("Ending line number:", (int) line_number, true);
+		bool was_taken = taken[source];
+		taken[source] = false;
 
 #ifdef COMMS_ERR2
 		static int comms_err = 0;
@@ -478,38 +606,233 @@ void GcodeQueue::parsebytes(char *bytes, uint8_t numbytes, uint8_t source)
 			line_number[source]--;
 			c.reset();
 			needserror[source] = false;
+			badcode[source] = false;
 			return;
 		}
 
+		// It came through fine, so sending it again wouldn't help; isparam()
+		// has said what's wrong, and it's acknowledged but not run.
+		if(badcode[source])
+		{
+			badcode[source] = false;
+			c.reset();
+			sendok(source);
+			return;
+		}
 
-		c.source = source;
-		enqueue(sources[source]);
 
+		dispatch(c, source, was_taken);
+	}
+	else
+	{
+		//HOST.write("Fragment parsed.\n");
+	}
+
+	return;
+
+}
+
+// Whether a word of a text line is a parameter for c: a letter with a number
+// after it, or nothing, as in G28 X.  Anything else, like the words of a
+// message, is noise.  A letter given twice, or more letters than a GCode has
+// room for (GCODE_MAX_PARAMS), spoil the whole line.
+bool GcodeQueue::isparam(GCode& c, char *word, uint8_t source)
+{
+	char v = word[1];
+	if(word[0] < 'A' || word[0] > 'Z')
+		return false;
+	if(v && v != '-' && v != '+' && v != '.' && (v < '0' || v > '9'))
+		return false;
+	if(badcode[source])
+		return false;
+
+	if(!c[word[0]].isUnused())
+		Host::Instance(source).labelnum("Repeated letter:", line_number[source]);
+	else if(c.paramsFree() == 0)
+		Host::Instance(source).labelnum("Too many letters:", line_number[source]);
+	else
+		return true;
+	badcode[source] = true;
+	return false;
+}
+
+// A finished line: real-time codes run now, unless the host already ran this
+// one out of its receive buffer (see Host::scanRealtime), and anything else
+// gets queued.
+void GcodeQueue::dispatch(GCode& c, uint8_t source, bool was_taken)
+{
+	c.source = source;
+	if(c[G].isUnused() && !c[M].isUnused() && GCode::isRealtime(c[M].getInt()))
+	{
+		if(!was_taken)
+			c.do_realtime();
+	}
+	else
+		enqueue(c);
+	checkwindow(c, source);
+	sendok(source);
+	checkbinary(c, source);
+}
+
+void GcodeQueue::sendok(uint8_t source)
+{
 #ifdef HAS_BT
-		if(source == HOST_SOURCE || source == BT_SOURCE)
+	if(source == HOST_SOURCE || source == BT_SOURCE)
 #else
-		if(source == HOST_SOURCE)
+	if(source == HOST_SOURCE)
 #endif
+	{
+		if(window[source])
 		{
+			Host::Instance(source).labelnum("ok Q:", codes.getCapacity(), false);
+			Host::Instance(source).labelnum(" B:", Host::Instance(source).rxfree(), true);
+			return;
+		}
 #ifndef REPRAP_COMPAT
-			Host::Instance(source).labelnum("ok ", codes.getCount(), true);
+		Host::Instance(source).labelnum("ok ", codes.getCount(), true);
 #else
-			Host::Instance(source).write_P(PSTR("ok \n"));
+		Host::Instance(source).write_P(PSTR("ok \n"));
 #endif
-		}
 	}
-	else
+}
+
+// M321 (or M321 P1) switches a serial host over to binary packets, and M321 P0
+// back to text.  It has to happen here rather than when the code runs, as the
+// host carries on in the new format as soon as it has its ok.  The first packet
+// is line 1.
+void GcodeQueue::checkbinary(GCode& c, uint8_t source)
+{
+#ifdef HAS_BT
+	if(source != HOST_SOURCE && source != BT_SOURCE)
+#else
+	if(source != HOST_SOURCE)
+#endif
+		return;
+	if(c[M].isUnused() || c[M].getInt() != 321)
+		return;
+
+	binary[source] = c[P].isUnused() || c[P].getInt() == 1;
+	if(binary[source])
+		line_number[source] = 0;
+	Host::Instance(source).resetInput();
+}
+
+// M322 P1 has every ok say how many gcode slots (Q:) and receive buffer bytes
+// (B:) are free, so a host can keep several lines in flight rather than wait
+// on each ok; see util/host.pl.  M322 P0 goes back to plain oks.  Switched as
+// it's parsed, so the M322 P1 ok itself carries the counts.
+void GcodeQueue::checkwindow(GCode& c, uint8_t source)
+{
+	if(c[M].isUnused() || c[M].getInt() != 322)
+		return;
+
+	window[source] = !c[P].isUnused() && c[P].getInt() == 1;
+}
+
+static uint16_t crc16_update(uint16_t crc, uint8_t data)
+{
+	crc ^= (uint16_t)data << 8;
+	for(uint8_t x=0;x<8;x++)
+		crc = (crc & 0x8000) ? (crc << 1) ^ 0x1021 : crc << 1;
+	return crc;
+}
+
+// Checks a packet's CRC and unpacks it into c, with the low 16 bits of its
+// line number.  False if it's damaged, too short for its mask, or has more
+// letters than a GCode has room for.
+bool GcodeQueue::decodepacket(uint8_t *bytes, GCode& c)
+{
+	uint8_t len = bytes[0];
+
+	uint16_t ourcrc = 0xFFFF;
+	for(uint8_t x=0;x<=len;x++)
+		ourcrc = crc16_update(ourcrc, bytes[x]);
+	if(len < 6 || ourcrc != (bytes[len+1] | (bytes[len+2] << 8)))
+		return false;
+
+	c.reset();
+	c.setLinenumber((uint16_t)bytes[1] | ((uint16_t)bytes[2] << 8));
+
+	uint32_t present = bytes[3] | ((uint32_t)bytes[4] << 8) | ((uint32_t)bytes[5] << 16) | ((uint32_t)bytes[6] << 24);
+	uint8_t *p = bytes + 7;
+	uint8_t *end = bytes + 1 + len;
+	if(present >> 26)
+		return false;
+	uint8_t letters = 0;
+	for(uint32_t b=present;b;b &= b - 1)
+		letters++;
+	if(letters > GCODE_MAX_PARAMS)
+		return false;
+
+	// M comes after E, but decides whether the axes are ints.
+	bool intaxes = false;
+	if(present & (1UL << ('M' - 'A')))
 	{
-		//HOST.write("Fragment parsed.\n");
+		uint8_t before = 0;
+		for(uint8_t b=0;b<'M'-'A';b++)
+			if(present & (1UL << b)) before++;
+		int32_t m;
+		if(p + 4*before + 4 <= end)
+		{
+			memcpy(&m, p + 4*before, 4);
+			intaxes = m >= 300;
+		}
 	}
 
-	return;
+	for(uint8_t b=0;b<26;b++)
+	{
+		if(!(present & (1UL << b)))
+			continue;
+		if(p + 4 > end)
+		{
+			c.reset();
+			return false;
+		}
 
+		char letter = 'A' + b;
+		bool axis = letter == 'X' || letter == 'Y' || letter == 'Z' || letter == 'E';
+		if(GCode::isIntParam(letter) || (axis && intaxes))
+		{
+			int32_t v;
+			memcpy(&v, p, 4);
+			c[letter].setInt(v);
+		}
+		else
+		{
+			float v;
+			memcpy(&v, p, 4);
+			c[letter].setFloat(v);
+		}
+		p += 4;
+	}
+	return true;
 }
 
-void GcodeQueue::Invalidate()
+void GcodeQueue::parsepacket(uint8_t *bytes, uint8_t source)
 {
-	invalidate_codes = true;
+	int32_t expect = line_number[source] + 1;
+	bool was_taken = taken[source];
+	taken[source] = false;
+
+	GCode& c = sources[source];
+	if(!decodepacket(bytes, c))
+	{
+		Host::Instance(source).labelnum("Bad packet:", expect);
+		Host::Instance(source).rxerror("Unknown.", expect);
+		return;
+	}
+
+	if((uint16_t)c.getLinenumber() != (uint16_t)expect)
+	{
+		Host::Instance(source).labelnum("Invalid line:", c.getLinenumber());
+		Host::Instance(source).rxerror("Unknown.", expect);
+		c.reset();
+		return;
+	}
+	line_number[source] = expect;
+	c.setLinenumber(expect);
+
+	dispatch(c, source, was_taken);
 }
 
 GcodeQueue& GCODES = GcodeQueue::Instance();
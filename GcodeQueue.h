@@ -7,7 +7,8 @@
  * A source is something on the system that wants to provide Gcode; e.g. the host, 
  * or the SD Card, or the Control Pad.
  * Fragments are a chunk of gcode up to and including a space or carriage return/newline (BUT NO MORE THAN THAT!)
- * Callers are presently expected to check isFull() before attempting to send a fragment.
+ * Callers are presently expected to check isFull() before attempting to send a fragment,
+ * unless the line is a real-time code (see GCode::isRealtime and inRealtimeLine()).
  *
  */
 
@@ -15,6 +16,22 @@
 #include "GCode.h"
 #include "config.h"
 #include "AvrPort.h"
+#include "Globals.h"
+#include "Point.h"
+#include "Host.h"
+
+// Binary packets, after M321: PACKET_SYNC, payload length, payload, then a
+// CRC16 (CCITT, 0xFFFF start, low byte first) of the length and payload.
+// The payload is the low 16 bits of the line number, a 32 bit mask of which
+// letters follow (bit 0 for A up to bit 25 for Z), then each in 4 bytes, in
+// letter order: an int32 where the text parser takes an int (see
+// GCode::isIntParam, and X, Y, Z and E after M300 and up), otherwise a float.
+// Everything is little endian.  No more than GCODE_MAX_PARAMS letters fit.
+#define PACKET_SYNC 0xA5
+// What Host::scanRealtime turns the sync byte into once it has run a packet's
+// real-time code.
+#define PACKET_TAKEN 0xA6
+#define MAX_PACKET_SIZE (6 + 4 * GCODE_MAX_PARAMS)
 
 class GcodeQueue
 {
@@ -23,9 +40,6 @@ public:
   static GcodeQueue& Instance() { static GcodeQueue instance; return instance; }
 private:
   explicit GcodeQueue()  :codes(GCODE_BUFSIZE, codes_buf)
-#ifdef USE_PRIORITY
-  , priority_codes(GCODE_PRIORITY_BUFSIZE, priority_buf)
-#endif  
   { 
     for(int x=0;x<GCODE_SOURCES;x++)
     {
@@ -35,10 +49,26 @@ private:
       line_number[x] = -1;
       chars_in_line[x] = 0;
       needserror[x] = false;
+      badcode[x] = false;
       ADVANCED_CRC[x] = false;
+      binary[x] = false;
+      window[x] = false;
+      taken[x] = false;
     }
     optimize_gcode = false;
     pause = false;
+    after_move = false;
+    starving = false;
+    starved = 0;
+    starved_ms = 0;
+    deferred = 0;
+    deferrals = 0;
+#ifdef MERGE_TOLERANCE
+    merge_tolerance = MERGE_TOLERANCE;
+    merge_ok = false;
+    merge_dev = 0;
+    merge_edev = 0;
+#endif
   }
   GcodeQueue(GcodeQueue const&);
   void operator=(const GcodeQueue&);
@@ -53,14 +83,39 @@ public:
   void setLineNumber(uint32_t l, uint8_t source);
   void setLineNumber(unsigned int l) { setLineNumber(l, 0); }
   // Drop a new gcode on the stack
-  void enqueue(GCode& c,int queue=0);
+  void enqueue(GCode& c);
   // Tells us whether queue is full.
-  bool isFull(int queue=0);
+  bool isFull() { return codes.isFull(); }
+  // Tells us whether there is nothing left to run.
+  bool isEmpty() { return codes.isEmpty(); }
+  // Drops everything queued; for M112.
+  void flush() { codes.reset(); }
+  // True partway through a real-time code, which needs no slot to finish.
+  bool inRealtimeLine(uint8_t source)
+  {
+    return taken[source] || (chars_in_line[source] > 0 && !sources[source][M].isUnused() && GCode::isRealtime(sources[source][M].getInt()));
+  }
+  // The line about to be parsed is a real-time code the host already ran;
+  // it only needs its line number and ok.  See Host::scanRealtime.
+  void markTaken(uint8_t source) { taken[source] = true; }
+  // Forget the line parsed so far; for M112, which drops everything received.
+  void abortLine(uint8_t source)
+  {
+    sources[source].reset();
+    crc_state[source] = NOCRC;
+    crc[source] = 0;
+    chars_in_line[source] = 0;
+    needserror[source] = false;
+    badcode[source] = false;
+    taken[source] = false;
+  }
   // Decode a (partial) gcode string
   void parsebytes(char *bytes, uint8_t numbytes) { parsebytes(bytes, numbytes, 0); }
   void parsebytes(char *bytes, uint8_t numbytes, uint8_t source);
-  // Dump all precalculated data and recompute
-  void Invalidate();
+  // Decode a binary packet: length, payload and CRC, without the sync byte
+  void parsepacket(uint8_t *bytes, uint8_t source);
+  static bool decodepacket(uint8_t *bytes, GCode& c);
+  bool isBinary(uint8_t source) { return binary[source]; }
 
   void enableOptimize() { optimize_gcode = true; };
   void disableOptimize() { optimize_gcode = false; };
@@ -68,15 +123,22 @@ public:
   void enableADVANCED_CRC(int source) { ADVANCED_CRC[source] = true; }
   void disableADVANCED_CRC(int source) { ADVANCED_CRC[source] = false; }
 
+#ifdef MERGE_TOLERANCE
+  void setMergeTolerance(float mm) { if(mm >= 0) merge_tolerance = mm; }
+#endif
+
+  // M313: how often the steppers stopped with a move still to come from this
+  // queue, for how long, and how often replanning was put off for lack of time.
+  void reportStarved(Host& h);
+  void clearStarved();
+
   void togglepause() { pause = !pause; }
+  void setPause(bool p) { pause = p; }
+  bool isPaused() { return pause; }
 
 private:
   GCode codes_buf[GCODE_BUFSIZE];
   RingBufferT<GCode> codes;
-#ifdef USE_PRIORITY
-  GCode priority_buf[GCODE_PRIORITY_BUFSIZE];
-  RingBufferT<GCode> priority_codes;
-#endif  
 
   GCode sources[GCODE_SOURCES];
   enum crc_state_t { NOCRC, CRC, CRCCOMPLETE } crc_state[GCODE_SOURCES];
@@ -84,10 +146,38 @@ private:
   int32_t line_number[GCODE_SOURCES];
   uint8_t chars_in_line[GCODE_SOURCES];
   bool needserror[GCODE_SOURCES];
-  bool invalidate_codes;
+  bool badcode[GCODE_SOURCES]; // arrived fine, but can't be run; see isparam()
   bool pause;
   bool optimize_gcode; // WTF is this here?  This whole pipeline needs serious refactor.
   bool ADVANCED_CRC[GCODE_SOURCES];
+  bool after_move; // the last code run was a move
+  bool starving;
+  unsigned long starve_since;
+  uint16_t starved;
+  unsigned long starved_ms;
+  uint16_t deferred;
+  uint8_t deferrals; // in a row, for PLAN_DEFERRALS
+  bool binary[GCODE_SOURCES];
+  bool window[GCODE_SOURCES]; // M322: oks say how much room is left
+  bool taken[GCODE_SOURCES]; // see markTaken()
+
+#ifdef MERGE_TOLERANCE
+  // The last queued code, if it's a G1 that more can be merged into: where it
+  // starts, and how far off its line the points already merged away may be.
+  float merge_tolerance;
+  bool  merge_ok;
+  Point merge_start;
+  float merge_dev;
+  float merge_edev;
+  bool merge(GCode& c, Point& from);
+#endif
+
+  void checkstarved();
+  void dispatch(GCode& c, uint8_t source, bool was_taken);
+  void sendok(uint8_t source);
+  void checkbinary(GCode& c, uint8_t source);
+  void checkwindow(GCode& c, uint8_t source);
+  bool isparam(GCode& c, char *word, uint8_t source);
 };
   
 extern GcodeQueue& GCODES;  
@@ -3,6 +3,10 @@
 
 #include "config.h"
 // QND function to estimate free ram.
+#ifdef SJFW_SIM
+// The host simulator has no AVR heap to measure.
+inline int getFreeRam () { return 0; }
+#else
 inline int getFreeRam () {
   // These externs are defined and used in libavr
   extern int __heap_start, *__brkval; 
@@ -11,11 +15,13 @@ inline int getFreeRam () {
 
   return (int) &v - (__brkval == 0 ? (int) &__heap_start : (int) __brkval) - sizeof(int); 
 }
+#endif
 
 // Whether I should define such common letters as globals is a bit questionable, but...
-// at any rate, it's CRITICAL the order here matches the array in GCode.  We also
-// assume multiple places that T is the last item, and the major axis are in order at the start.
-enum { X=0, Y, Z, E, M, G, F, P, S, T };
+// at any rate, it's CRITICAL the order here matches gcode_param_letters in GCode.cpp.
+// Other letters are reached by the letter itself, e.g. gcode['H'].  We also assume
+// multiple places that T is the last item, and the major axis are in order at the start.
+enum { X=0, Y, Z, E, M, G, F, P, S, I, J, K, R, T };
 
 
 #endif
@@ -6,6 +6,7 @@
 #include <avr/interrupt.h>
 #include <util/atomic.h>
 #include "GcodeQueue.h"
+#include "IsrProfile.h"
 
 #include "config.h"
 
@@ -15,6 +16,8 @@ Host::Host(unsigned long BAUD, int port_in)
 	: rxring(HOST_RECV_BUFSIZE, rxbuf), txring(HOST_SEND_BUFSIZE, txbuf)
 {
 	input_ready = 0;
+	rt_scan = 0;
+	rt_skip = false;
 	port = port_in;
 #ifdef HIGHPORTS
 #ifdef HAS_BT
@@ -79,10 +82,18 @@ void Host::Init2(unsigned long BAUD)
 
 void Host::scan_input()
 {
+	scanRealtime();
+
+	if(GCODES.isBinary(port))
+	{
+		scan_packet();
+		return;
+	}
+
 	if(input_ready == 0)
 		return;
 
-	if(GCODES.isFull())
+	if(GCODES.isFull() && !GCODES.inRealtimeLine(port) && !realtimeWaiting())
 		return;
 
 	char buf[MAX_GCODE_FRAG_SIZE];
@@ -97,7 +108,7 @@ void Host::scan_input()
 	for(len=0;len<MAX_GCODE_FRAG_SIZE;len++)
 	{
 		buf[len] = rxring.pop();
-		if(buf[len] <= 32)
+		if((uint8_t)buf[len] <= 32)
 			break;
 	}
 
@@ -105,9 +116,18 @@ void Host::scan_input()
 
 	if(len == MAX_GCODE_FRAG_SIZE)
 	{
+		consumed(len, false);
 		rxerror("Frag Over");
 		return;
 	}
+	consumed(len + 1, buf[len] == '\n' || buf[len] == '\r');
+
+	// Marked by scanRealtime(); the high bit isn't part of the line.
+	if(buf[0] & 0x80)
+	{
+		buf[0] &= 0x7F;
+		GCODES.markTaken(port);
+	}
 
 #ifdef HAS_BT
 #ifdef BT_DEBUG
@@ -128,14 +148,336 @@ void Host::scan_input()
 
 
 
+// Binary mode; see GcodeQueue.h.  Waits until a whole packet is in, and skips
+// anything that isn't one, so a garbled packet costs just itself.
+void Host::scan_packet()
+{
+	// The rx interrupt still counts text fragments; they mean nothing here.
+	resetInput();
+
+	while(rxchars() && peekchar() != PACKET_SYNC && peekchar() != PACKET_TAKEN)
+	{
+		popchar();
+		consumed(1, true);
+	}
+	if(rxchars() < 2)
+		return;
+
+	uint8_t len = rxring.peek(1);
+	if(len > MAX_PACKET_SIZE)
+	{
+		popchar();
+		consumed(1, true);
+		return;
+	}
+	if(rxchars() < len + 4)
+		return;
+	if(GCODES.isFull() && !realtimeWaiting())
+		return;
+
+	uint8_t buf[MAX_PACKET_SIZE + 3];
+	if(popchar() == PACKET_TAKEN)
+		GCODES.markTaken(port);
+	for(uint8_t x=0;x<len+3;x++)
+		buf[x] = popchar();
+	consumed(len + 4, true);
+	GCODES.parsepacket(buf, port);
+}
+
+
+
+// A real-time code (see GCode::isRealtime) mustn't wait behind the moves
+// ahead of it, in rxring any more than in the gcode queue.  So each time
+// round, every whole line or packet that has come in since is looked at here,
+// in place; a real-time code is run straight away and marked (the high bit of
+// its first byte, or PACKET_TAKEN for its sync byte) so that the parser, when
+// it gets there, only takes its line number and sends the ok.  An M112 also
+// drops everything received up to it, since none of that should run now, and
+// says how many lines that was (see reportDropped()).
+// Nothing is looked at past an M321, which changes what the rest means.
+void Host::scanRealtime()
+{
+	uint8_t n = rxchars();
+	uint8_t *p = &rxring.peek(rt_scan);
+
+	if(GCODES.isBinary(port))
+	{
+		// Skips what the parser will skip; see scan_packet()
+		while(rt_scan < n)
+		{
+			if(*p != PACKET_SYNC && *p != PACKET_TAKEN)
+			{
+				rt_scan++;
+				p = rxring.next(p);
+				continue;
+			}
+			if(rt_scan + 2 > n)
+				return;
+			uint8_t len = *rxring.next(p);
+			if(len > MAX_PACKET_SIZE)
+			{
+				rt_scan++;
+				p = rxring.next(p);
+				continue;
+			}
+			if(rt_scan + len + 4 > n)
+				return;
+			if(*p == PACKET_SYNC && !takePacket(rt_scan, len))
+				return;
+			rt_scan += len + 4;
+			p = &rxring.peek(rt_scan);
+		}
+		return;
+	}
+
+	while(rt_scan < n)
+	{
+		uint8_t eol = rt_scan;
+		uint8_t *q = p;
+		while(eol < n && *q != '\n' && *q != '\r')
+		{
+			eol++;
+			q = rxring.next(q);
+		}
+		// Not all in yet
+		if(eol >= n)
+			return;
+		if(!rt_skip && !takeLine(rt_scan, eol - rt_scan))
+			return;
+		rt_skip = false;
+		rt_scan = eol + 1;
+		p = rxring.next(q);
+	}
+}
+
+// The text line len bytes long, from bytes into rxring; false to look no
+// further for now.  Only a line that starts (after any N word) with the
+// M code is taken, and not if its checksum is wrong: the parser will have
+// it sent again.  It's read a word at a time where it lies, so a line of any
+// length is looked at; only the start of each word is kept.
+bool Host::takeLine(uint8_t from, uint8_t len)
+{
+	char word[MAX_GCODE_FRAG_SIZE];
+	uint8_t *p = &rxring.peek(from);
+	uint8_t x = 0, first = len;
+	uint8_t cs = 0;
+	long n = -1, m = -1;
+	GCode c;
+
+	while(true)
+	{
+		for(;x < len && *p <= 32;x++,p=rxring.next(p))
+		{
+			if(first < len)
+				cs ^= *p;
+		}
+		if(x >= len)
+			break;
+
+		// A word runs to whitespace, or to the '*' that starts the checksum.
+		uint8_t start = x, wl = 0;
+		for(;x < len && *p > 32 && (wl == 0 || *p != '*');x++,p=rxring.next(p))
+		{
+			if(wl < sizeof(word) - 1)
+				word[wl++] = *p;
+			if(word[0] != '*')
+				cs ^= *p;
+		}
+		word[wl] = 0;
+
+		// The checksum would have had to come before a comment.
+		if(word[0] == ';')
+			break;
+		if(word[0] == '*')
+		{
+			if(atoi(word + 1) != cs)
+				return true;
+			break;
+		}
+		if(first == len)
+		{
+			first = start;
+			if(word[0] == 'N')
+			{
+				n = atol(word + 1);
+				continue;
+			}
+		}
+		if(m < 0)
+		{
+			if(word[0] != 'M')
+				return true;
+			m = atol(word + 1);
+			if(m == 321)
+				return false;
+			if(!GCode::isRealtime(m))
+				return true;
+			continue;
+		}
+		if(word[0] == 'S' || word[0] == 'P')
+			c[word[0]].setInt(atol(word + 1));
+	}
+	if(m < 0)
+		return true;
+
+	c.source = port;
+	c[M].setInt(m);
+
+	if(m == 112)
+	{
+		c.do_realtime();
+		reportDropped(dropInput(from + len + 1) - 1);
+		if(n >= 0)
+			GCODES.setLineNumber(n + 1, port);
+		return false;
+	}
+
+	rxring.peek(from + first) |= 0x80;
+	c.do_realtime();
+	return true;
+}
+
+// The packet at from bytes into rxring, whose length byte is len.
+bool Host::takePacket(uint8_t from, uint8_t len)
+{
+	uint8_t buf[MAX_PACKET_SIZE + 3];
+	uint8_t *p = &rxring.peek(from + 1);
+	for(uint8_t x=0;x<len+3;x++,p=rxring.next(p))
+		buf[x] = *p;
+
+	GCode c;
+	if(!GcodeQueue::decodepacket(buf, c) || c[M].isUnused() || !c[G].isUnused())
+		return true;
+	if(c[M].getInt() == 321)
+		return false;
+	if(!GCode::isRealtime(c[M].getInt()))
+		return true;
+
+	c.source = port;
+	if(c[M].getInt() == 112)
+	{
+		uint16_t l = c.getLinenumber();
+		c.do_realtime();
+		reportDropped(dropInput(from + len + 4) - 1);
+		GCODES.setLineNumber(l + 1, port);
+		return false;
+	}
+
+	rxring.peek(from) = PACKET_TAKEN;
+	c.do_realtime();
+	return true;
+}
+
+// The parser took n bytes off the front of rxring.
+void Host::consumed(uint8_t n, bool lineend)
+{
+	if(n <= rt_scan)
+	{
+		rt_scan -= n;
+		return;
+	}
+	// It got past us, into a line we hadn't seen the end of.
+	rt_scan = 0;
+	rt_skip = !lineend;
+}
+
+// Throw away the first n bytes received, and whatever line the parser was
+// partway through.  Gives how many lines or packets that was, counting one
+// the parser had started on.
+uint8_t Host::dropInput(uint8_t n)
+{
+	uint8_t lines = 0;
+	uint8_t *p = &rxring.peek(0);
+	if(GCODES.isBinary(port))
+	{
+		// Walked the way scanRealtime() does.
+		for(uint8_t x=0;x<n;)
+		{
+			uint8_t len = x + 1 < n ? *rxring.next(p) : 0xFF;
+			if((*p != PACKET_SYNC && *p != PACKET_TAKEN) || len > MAX_PACKET_SIZE)
+			{
+				x++;
+				p = rxring.next(p);
+				continue;
+			}
+			lines++;
+			x += len + 4;
+			p = &rxring.peek(x);
+		}
+	}
+	else
+	{
+		bool started = false;
+		for(uint8_t x=0;x<n;x++,p=rxring.next(p))
+		{
+			if(*p == '\n' || *p == '\r')
+			{
+				if(started)
+					lines++;
+				started = false;
+			}
+			else if(*p > 32)
+				started = true;
+		}
+	}
+
+	ATOMIC_BLOCK(ATOMIC_RESTORESTATE)
+	{
+		rxring.remove(n);
+		uint8_t left = rxring.getCount();
+		p = &rxring.peek(0);
+		input_ready = 0;
+		for(uint8_t x=0;x<left;x++,p=rxring.next(p))
+		{
+			if(*p <= 32)
+				input_ready++;
+		}
+	}
+	rt_scan = 0;
+	rt_skip = false;
+	GCODES.abortLine(port);
+	return lines;
+}
+
+// After an M112, how many lines or packets received ahead of it were thrown
+// away unrun, with neither ok nor rs; the host mustn't wait on them.
+void Host::reportDropped(uint8_t lines)
+{
+	if(lines)
+		labelnum("Dropped:", lines);
+}
+
+
+
+// With the gcode queue full we stop reading, but a real-time code needn't
+// wait for a slot.  scanRealtime() will already have run it, so this only
+// has to let the parser through to it: the next line or packet is marked.
+bool Host::realtimeWaiting()
+{
+	uint8_t n = rxchars();
+	uint8_t *p = &rxring.peek(0);
+
+	if(GCODES.isBinary(port))
+		return n && *p == PACKET_TAKEN;
+
+	uint8_t x = 0;
+	for(;x < n && *p <= 32;x++)
+		p = rxring.next(p);
+	return x < n && (*p & 0x80);
+}
+
+
+
 /*** INTERRUPT HANDLERS ***/
 ISR(USART0_RX_vect)
 {
+	PROFILE_ISR(SERIAL_RX);
 	HOST.rx_interrupt_handler0();
 }
 
 ISR(USART0_UDRE_vect)
 {
+	PROFILE_ISR(SERIAL_TX);
 	HOST.udre_interrupt_handler0();
 }
 
@@ -10,6 +10,7 @@
 
 #include "RingBuffer.h"
 #include <avr/interrupt.h>
+#include <util/atomic.h>
 #include <stdlib.h>
 #include "config.h"
 #include <avr/pgmspace.h>
@@ -53,6 +54,7 @@ class Host
 	public:
 
 		uint8_t rxchars() { uint8_t l = rxring.getCount(); return l; }
+		uint8_t rxfree() { uint8_t l = rxring.getCapacity(); return l; }
 		uint8_t popchar() { uint8_t c = rxring.pop(); return c; }
 		uint8_t peekchar() { uint8_t c = rxring.peek(0); return c; }
 
@@ -122,7 +124,15 @@ class Host
 			if(end)
 				endl();
 		}
+#ifndef SJFW_SIM
 		void labelnum(const char *label, int num, bool end=true) { labelnum(label, (uint16_t)num, end); };
+#else
+		// Host simulator: int is already int32_t there, and long is 64 bits.
+		void labelnum(const char *label, long num, bool end=true) { labelnum(label, (int32_t)num, end); };
+		void labelnum(const char *label, unsigned long num, bool end=true) { labelnum(label, (uint32_t)num, end); };
+		void write(long n, int radix) { write((int32_t)n, radix); }
+		void write(unsigned long n, int radix) { write((uint32_t)n, radix); }
+#endif
 
 		void labelnum(const char *label, float num, bool end=true)
 		{
@@ -154,6 +164,11 @@ class Host
 		}
 
 		void scan_input();
+		void scan_packet();
+		void scanRealtime();
+		bool realtimeWaiting();
+		// Forget any text fragments counted so far; see GcodeQueue::checkbinary
+		void resetInput() { ATOMIC_BLOCK(ATOMIC_RESTORESTATE) { input_ready = 0; } }
 
 		void rx_interrupt_handler0()
 		{
@@ -201,6 +216,16 @@ class Host
 		RingBufferT<uint8_t> txring;
 		volatile uint8_t input_ready;
 
+		// scanRealtime() has looked at everything up to rt_scan bytes past the
+		// front of rxring; rt_skip says that's partway through a line.
+		uint8_t rt_scan;
+		bool rt_skip;
+		bool takeLine(uint8_t from, uint8_t len);
+		bool takePacket(uint8_t from, uint8_t len);
+		void consumed(uint8_t n, bool lineend);
+		uint8_t dropInput(uint8_t n);
+		void reportDropped(uint8_t lines);
+
 };
 
 extern Host& HOST;
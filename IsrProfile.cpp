@@ -0,0 +1,99 @@
+#include "IsrProfile.h"
+
+#ifdef ISR_PROFILE
+#include <avr/pgmspace.h>
+#include <util/atomic.h>
+
+// Histogram buckets double from under 64 cycles up to 4096 and over.
+#define ISR_PROFILE_BUCKETS 8
+
+namespace isrprofile
+{
+  struct stats_t
+  {
+    uint32_t count;
+    uint64_t total;
+    uint16_t min;
+    uint16_t max;
+    uint32_t hist[ISR_PROFILE_BUCKETS];
+  };
+
+  static stats_t stats[NUM_ISRS];
+
+  void init()
+  {
+    // Normal mode, no prescaler; nothing else uses TIMER5.
+    TCCR5A = 0;
+    TCCR5B = _BV(CS50);
+    reset();
+  }
+
+  void reset()
+  {
+    ATOMIC_BLOCK(ATOMIC_RESTORESTATE)
+    {
+      for(uint8_t x=0;x<NUM_ISRS;x++)
+      {
+        stats_t& s = stats[x];
+        s.count = 0;
+        s.total = 0;
+        s.min = 0xFFFF;
+        s.max = 0;
+        for(uint8_t b=0;b<ISR_PROFILE_BUCKETS;b++)
+          s.hist[b] = 0;
+      }
+    }
+  }
+
+  // Called from the handler itself, so keep it short.
+  void record(uint8_t which, uint16_t start)
+  {
+    uint16_t cycles = TCNT5 - start;
+    stats_t& s = stats[which];
+    s.count++;
+    s.total += cycles;
+    if(cycles < s.min) s.min = cycles;
+    if(cycles > s.max) s.max = cycles;
+
+    uint8_t b = 0;
+    for(cycles >>= 6;cycles && b < ISR_PROFILE_BUCKETS-1;cycles >>= 1)
+      b++;
+    s.hist[b]++;
+  }
+
+  void report(Host& h)
+  {
+    for(uint8_t x=0;x<NUM_ISRS;x++)
+    {
+      stats_t s;
+      ATOMIC_BLOCK(ATOMIC_RESTORESTATE)
+      {
+        s = stats[x];
+      }
+
+      h.labelnum("IP:", x, false);
+      switch(x)
+      {
+        case STEP:      h.write_P(PSTR(" step")); break;
+        case SERIAL_RX: h.write_P(PSTR(" rx")); break;
+        case SERIAL_TX: h.write_P(PSTR(" tx")); break;
+        case ADC_DONE:  h.write_P(PSTR(" adc")); break;
+      }
+      h.labelnum(" n:", s.count, false);
+      if(s.count)
+      {
+        h.labelnum(" min:", s.min, false);
+        h.labelnum(" max:", s.max, false);
+        h.labelnum(" avg:", (uint32_t)(s.total / s.count), false);
+      }
+      h.write_P(PSTR(" hist:"));
+      for(uint8_t b=0;b<ISR_PROFILE_BUCKETS;b++)
+      {
+        h.write(' ');
+        h.write(s.hist[b], 10);
+      }
+      h.endl();
+    }
+  }
+};
+#endif
@@ -0,0 +1,48 @@
+#ifndef _ISRPROFILE_H_
+#define _ISRPROFILE_H_
+/* Interrupt cycle counts, so we can see what the step interrupt and friends
+ * really cost on a given machine instead of guessing from stutter.
+ *
+ * With ISR_PROFILE defined, TIMER5 runs free at F_CPU and each profiled
+ * handler reads it on the way in and out.  Times are in CPU cycles and take in
+ * anything that interrupted the handler (the step interrupt lets serial in);
+ * anything over 65535 cycles (4ms) wraps.  M311 reports them.
+ */
+
+#include "config.h"
+
+#ifdef ISR_PROFILE
+#include <avr/io.h>
+#include "Host.h"
+
+#ifndef TCNT5
+#error ISR_PROFILE needs TIMER5 (ATmega1280/2560)
+#endif
+
+namespace isrprofile
+{
+  enum { STEP, SERIAL_RX, SERIAL_TX, ADC_DONE, NUM_ISRS };
+
+  void init();
+  void record(uint8_t which, uint16_t start);
+  void report(Host& h);
+  void reset();
+
+  // Times the handler from here to the end of the enclosing scope.
+  class Scope
+  {
+  public:
+    Scope(uint8_t w) :which(w), start(TCNT5) {}
+    ~Scope() { record(which, start); }
+  private:
+    uint8_t which;
+    uint16_t start;
+  };
+};
+
+#define PROFILE_ISR(which) isrprofile::Scope _isr_profile(isrprofile::which)
+#else
+#define PROFILE_ISR(which)
+#endif
+
+#endif // _ISRPROFILE_H_
@@ -7,6 +7,13 @@
 #include "GcodeQueue.h"
 #include "ArduinoMap.h"
 #include <avr/pgmspace.h>
+#include "speed_lookuptable.h"
+#include "IsrProfile.h"
+#include "StepTrace.h"
+
+#if F_CPU != 16000000
+#error speed_lookuptable.h is computed for a 16MHz clock
+#endif
 
 
 
@@ -18,14 +25,34 @@
 
 void Motion::setFeedModifier(float mod)
 {
+  if(mod < 1)
+    mod = 1;
   feed_modifier = mod/100.0f;
+  feed_scale = feed_modifier * 256.0f > 0xFFFF ? 0xFFFF : feed_modifier * 256.0f;
 
+  // The interrupt only works out a new interval as the speed changes, so a
+  // move at full speed would otherwise carry on at the old rate to its end.
+  ATOMIC_BLOCK(ATOMIC_RESTORESTATE)
+  {
+    if(current_block != NULL && current_block->state == MoveBlock::ACTIVE)
+    {
+      current_block->currentinterval = interval_from_rate(current_block->currentrate);
+      setInterruptCycles(current_block->currentinterval);
+    }
+  }
 }
 float Motion::getFeedModifier()
 {
   return(feed_modifier*100.0f);
 }
 
+void Motion::setJunctionDeviation(float mm)
+{
+  // Moves already in the queue keep the corners they were planned with.
+  if(mm < 0) return;
+  junction_deviation = mm;
+}
+
 
  
 Point& Motion::getCurrentPosition()
@@ -45,6 +72,129 @@ void Motion::setCurrentPosition(GCode &gcode)
       AXES[ax].setCurrentPosition(gcode[ax].getFloat());
     }
   }
+  syncPlanpos();
+}
+
+void Motion::syncPlanpos()
+{
+  for(int ax=0;ax<NUM_AXES;ax++)
+    planpos[ax] = AXES[ax].getPositionSteps();
+}
+
+bool Motion::isAxisQueued(int ax)
+{
+  for(unsigned int x=0;x<blocks.getCount();x++)
+  {
+    if(blocks.peek(x).axismovesteps[ax])
+      return true;
+  }
+  return false;
+}
+
+// Should be called often from mainloop; retires finished moves, starts the
+// next one, and replans the queue when it has changed.
+void Motion::handlenext()
+{
+  while(!blocks.isEmpty() && blocks.peek(0).state == MoveBlock::DONE)
+  {
+#ifdef DEBUG_MOVE
+    blocks.peek(0).dump_movedata();
+#endif
+    blocks.pop();
+  }
+
+  // An endstop cut a move short, so the head move (the one that wouldn't load)
+  // doesn't start where it was planned to.  Only it needs working out again;
+  // everything after it still starts where the move ahead of it ends.
+  if(invalidate_moves)
+  {
+    invalidate_moves = false;
+    if(!blocks.isEmpty())
+      rebaseHead();
+    else
+      syncPlanpos();
+  }
+
+  if(!blocks.isEmpty() && blocks.peek(0).state == MoveBlock::PLANNED && !GCODES.isPaused())
+    startMove(blocks.peek(0));
+}
+
+bool Motion::needsPlan()
+{
+  return GCODES.shouldOptimize() && replan;
+}
+
+static uint32_t mul_capped(uint32_t a, uint32_t b, uint32_t cap)
+{
+  if(b && a > cap / b)
+    return cap;
+  return a * b;
+}
+
+// What's left of the running move at its current speed, and the planned ones
+// after it at their top speeds, so it errs short.
+uint32_t Motion::queuedTime(uint32_t enough)
+{
+  uint32_t steps = 0, interval = 0;
+  ATOMIC_BLOCK(ATOMIC_RESTORESTATE)
+  {
+    if(current_block != NULL && current_block->state == MoveBlock::ACTIVE)
+    {
+      steps = current_block->movesteps;
+      interval = current_block->currentinterval;
+    }
+  }
+
+  uint32_t t = mul_capped(steps, interval / cyclesPerMicro(), enough);
+  for(unsigned int x=0;x<blocks.getCount() && t < enough;x++)
+  {
+    MoveBlock& b = blocks.peek(x);
+    if(b.state != MoveBlock::PLANNED || b.maxrate == 0)
+      continue;
+    t += mul_capped(b.movesteps, 256000000UL / b.maxrate, enough);
+  }
+  return t < enough ? t : enough;
+}
+
+// Re-precalc the head move from where the axes actually are, then replan it
+// along with the rest so the next move's start feed matches its new end feed.
+// The corner into the next move has changed shape too, so its cached
+// max_entry has to be worked out again.
+void Motion::rebaseHead()
+{
+  MoveBlock& head = blocks.peek(0);
+  int32_t tail[NUM_AXES], target[NUM_AXES];
+  for(int ax=0;ax<NUM_AXES;ax++)
+  {
+    tail[ax] = planpos[ax];
+    target[ax] = head.getEndpos(ax);
+    planpos[ax] = AXES[ax].getPositionSteps();
+  }
+  precalc(head, target);
+  for(int ax=0;ax<NUM_AXES;ax++)
+    planpos[ax] = tail[ax];
+  if(blocks.getCount() > 1)
+    blocks.peek(1).max_entry = 0;
+
+#ifdef DEBUG_MOVE
+  HOST.write_P(PSTR("\nREBASED MOVE\n"));
+#endif
+  if(GCODES.shouldOptimize())
+    plan(0);
+}
+
+// Lookahead over the queue from index 'from'.  The head move may already be
+// running, so normally that's 1.  The interrupt may also have moved on into
+// any of the rest; see gcode_plan.
+void Motion::plan(uint8_t from)
+{
+  MoveBlock* run[MOVE_BUFSIZE];
+  uint8_t len = 0;
+
+  replan = false;
+  for(unsigned int x=from;x<blocks.getCount();x++)
+    run[len++] = &blocks.peek(x);
+  gcode_plan(run, len);
 }
 
 
@@ -82,6 +232,7 @@ void Motion::setStepsPerUnit(GCode& gcode)
     if(gcode[ax].isUnused()) continue;
     AXES[ax].setStepsPerUnit(gcode[ax].getFloat());
   }
+  syncPlanpos();
 }
 
 void Motion::setAccel(GCode& gcode)
@@ -103,7 +254,7 @@ void Motion::setAccel(GCode& gcode)
   } 
  
 
-void Motion::setStepPins(GCode& gcode) { MOT_CHANGEPIN(changepinStep); }
+void Motion::setStepPins(GCode& gcode) { MOT_CHANGEPIN(changepinStep); groupStepPins(); }
 void Motion::setDirPins(GCode& gcode) { MOT_CHANGEPIN(changepinDir); }
 void Motion::setEnablePins(GCode& gcode) { MOT_CHANGEPIN(changepinEnable); }
 void Motion::setMinPins(GCode& gcode) { MOT_CHANGEPIN(changepinMin); }
@@ -176,6 +327,32 @@ void Motion::checkdisable(GCode& gcode)
   // This was STUPID
 }
 
+// Steps already taken are kept, so the position is right as long as the
+// motors didn't skip stopping dead.
+void Motion::emergencyStop()
+{
+  disableInterrupt();
+  interruptOverflow = 0;
+  blocks.reset();
+  for(int x=0;x<MOVE_BUFSIZE;x++)
+    blocks_buf[x].state = MoveBlock::DONE;
+  current_block = NULL;
+  arc_active = false;
+  replan = false;
+  invalidate_moves = false;
+  // Axis::position only moves on at the end of a move, so count in the steps
+  // the interrupted one had taken, and the extruder's advance lead.
+  for(int ax=0;ax<NUM_AXES;ax++)
+    AXES[ax].abortMove(0);
+#ifdef LINEAR_ADVANCE_K
+  AXES[E].abortMove(advance_steps);
+  advance_steps = 0;
+  advance_target = 0;
+#endif
+  syncPlanpos();
+  disableAllMotors();
+}
+
 void Motion::disableAxis(int axis)
 {
   AXES[axis].disableIfConfigured();
@@ -184,600 +361,738 @@ void Motion::disableAxis(int axis)
 
 
 
-void Motion::getMovesteps(GCode& gcode)
+void Motion::getMovesteps(MoveBlock& block, int32_t* target)
 {
+  block.movesteps = 0;
+  block.leading_axis = 0;
+  block.axisdirs = 0;
   for(int ax=0;ax < NUM_AXES;ax++)
   {
-    gcode.axismovesteps[ax] = AXES[ax].getMovesteps(gcode.startpos[ax], 
-                                                             gcode[ax].isUnused() ? gcode.startpos[ax] : gcode[ax].getFloat(), 
-                                                             gcode.axisdirs[ax]);
-    if(gcode.movesteps < gcode.axismovesteps[ax])
+    int32_t d = target[ax] - block.startpos[ax];
+    if(d >= 0)
+      block.axisdirs |= _BV(ax);
+    block.axismovesteps[ax] = d >= 0 ? d : -d;
+    if(block.movesteps < block.axismovesteps[ax])
     {
-      gcode.movesteps = gcode.axismovesteps[ax];
-      gcode.leading_axis = ax;
+      block.movesteps = block.axismovesteps[ax];
+      block.leading_axis = ax;
     }
   }
 }
 
-float Motion::getSmallestStartFeed(GCode& gcode)
-{
-  float mi = 9999999;
-  for(int ax=0;ax < NUM_AXES;ax++)
-  {
-    if(gcode.axismovesteps[ax] == 0) continue;
-    float t = AXES[ax].getStartFeed(gcode.feed);
-    if(t < mi) mi = t;
-  }
-  return mi;
-}
 
-float Motion::getSmallestEndFeed(GCode& gcode)
+// Turns a G1 into a MoveBlock on the end of the move queue.  Returns false if
+// the queue is full, in which case try again later.
+bool Motion::gcode_precalc(GCode& gcode, float& feedin)
 {
-  float mi = 9999999;
-  for(int ax=0;ax < NUM_AXES;ax++)
+  // Make sure they have configured the axis!
+  if(AXES[0].isInvalid())
   {
-    if(gcode.axismovesteps[ax] == 0) continue;
-    float t = AXES[ax].getEndFeed(gcode.feed);
-    if(t < mi) mi = t;
+    Host::Instance(gcode.source).write_P(PSTR("!! AXIS ARE NOT CONFIGURED !!\n"));
+    return true;
   }
-  return mi;
-}
 
-void Motion::getActualEndpos(GCode& gcode)
-{
+  // G0 doesn't move in sjfw.
+  if(gcode[G].getInt() != 1)
+    return true;
+
+  if(blocks.isFull())
+    return false;
+
+  // We want to carry over the previous ending position and feedrate if possible.
+  if(!gcode[F].isUnused())
+    feedin = gcode[F].getFloat();
+  if(feedin == 0)
+    feedin = SAFE_DEFAULT_FEED;
+
+  int32_t target[NUM_AXES];
   for(int ax=0;ax<NUM_AXES;ax++)
   {
-    gcode.endpos[ax] = AXES[ax].getEndpos(gcode.startpos[ax], gcode.axismovesteps[ax], gcode.axisdirs[ax]);
+    if(gcode[ax].isUnused())
+      target[ax] = planpos[ax];
+    else
+      target[ax] = AXES[ax].getStepsFromMM(gcode[ax].getFloat());
   }
+
+  queueMove(target, gcode.linenum, feedin);
+  return true;
 }
 
 
-void Motion::gcode_precalc(GCode& gcode, float& feedin, Point* lastend)
+// Turns a G2/G3 into chords on the end of the move queue, a few at a time:
+// as many as there's room for on each call, so a big arc doesn't need a big
+// queue and the first chords can be running while the rest are worked out.
+// Returns true when the last chord is queued.
+// Centers are I,J,K offsets from the start (whichever two the plane uses), or
+// an R radius; a negative R takes the long way round.
+bool Motion::gcode_arc(GCode& gcode, float& feedin)
 {
-  if(gcode.state >= GCode::PREPARED)
-    return;
+  if(AXES[0].isInvalid())
+  {
+    Host::Instance(gcode.source).write_P(PSTR("!! AXIS ARE NOT CONFIGURED !!\n"));
+    return true;
+  }
 
-  if(gcode[G].isUnused())
-    return;
+  if(!gcode[F].isUnused())
+    feedin = gcode[F].getFloat();
+  if(feedin == 0)
+    feedin = SAFE_DEFAULT_FEED;
 
-  if(gcode[G].getInt() == 92)
+  if(!arc_active)
   {
-    // Just carry over new position
+    arc_axes[0] = arc_plane == 1 ? Z : arc_plane == 2 ? Y : X;
+    arc_axes[1] = arc_plane == 1 ? X : arc_plane == 2 ? Z : Y;
     for(int ax=0;ax<NUM_AXES;ax++)
     {
-      if(!gcode[ax].isUnused())
-      {
-        (*lastend)[ax] = gcode[ax].getFloat();
-      }
+      arc_start[ax] = planpos[ax] / AXES[ax].getStepsPerMM();
+      arc_end[ax] = gcode[ax].isUnused() ? arc_start[ax] : gcode[ax].getFloat();
     }
-    gcode.state = GCode::PREPARED;
-    return;
+
+    float x = arc_end[arc_axes[0]] - arc_start[arc_axes[0]];
+    float y = arc_end[arc_axes[1]] - arc_start[arc_axes[1]];
+    float ci, cj;
+    if(!gcode[R].isUnused())
+    {
+      // The center is on the perpendicular bisector of the chord.
+      float r = gcode[R].getFloat();
+      float d2 = x*x + y*y;
+      float h = 4*r*r - d2;
+      if(d2 == 0)
+        h = 0;
+      else
+        h = h > 0 ? -sqrt(h / d2) : 0;
+      if(gcode[G].getInt() == 3) h = -h;
+      if(r < 0) h = -h;
+      ci = 0.5f * (x - y*h);
+      cj = 0.5f * (y + x*h);
+    }
+    else
+    {
+      // Offsets for X, Y and Z are I, J and K.
+      ci = gcode[I + arc_axes[0]].isUnused() ? 0 : gcode[I + arc_axes[0]].getFloat();
+      cj = gcode[I + arc_axes[1]].isUnused() ? 0 : gcode[I + arc_axes[1]].getFloat();
+    }
+
+    arc_center[0] = arc_start[arc_axes[0]] + ci;
+    arc_center[1] = arc_start[arc_axes[1]] + cj;
+    arc_radius = sqrt(ci*ci + cj*cj);
+    arc_angle = atan2(-cj, -ci);
+    arc_sweep = atan2(arc_end[arc_axes[1]] - arc_center[1], arc_end[arc_axes[0]] - arc_center[0]) - arc_angle;
+    // Ending where it starts is a full circle.  The start is planpos, which is
+    // rounded to a step, so "where it starts" means the same step.
+    if(AXES[arc_axes[0]].getStepsFromMM(arc_end[arc_axes[0]]) == planpos[arc_axes[0]] &&
+       AXES[arc_axes[1]].getStepsFromMM(arc_end[arc_axes[1]]) == planpos[arc_axes[1]])
+      arc_sweep = gcode[G].getInt() == 2 ? -2*M_PI : 2*M_PI;
+    else if(gcode[G].getInt() == 2)
+    {
+      if(arc_sweep >= 0)
+        arc_sweep -= 2*M_PI;
+    }
+    else if(arc_sweep <= 0)
+      arc_sweep += 2*M_PI;
+
+    // A chord through angle a strays r(1 - cos(a/2)) from the arc.
+    float segs = 1;
+    if(arc_radius > arc_tolerance)
+      segs = ceil(fabs(arc_sweep) / (2 * acos(1 - arc_tolerance / arc_radius)));
+    arc_segments = segs > 0xFFFF ? 0xFFFF : segs < 1 ? 1 : segs;
+    arc_next = 1;
+    arc_active = true;
   }
-  if(gcode[G].getInt() != 1 and gcode[G].getInt() != 2)
+
+  int32_t target[NUM_AXES];
+  for(;arc_next <= arc_segments;arc_next++)
   {
-    // no precalc for anything but 92, 1, 2
-    gcode.state = GCode::PREPARED;
-    return;
+    if(blocks.isFull())
+      return false;
+
+    if(arc_next == arc_segments)
+    {
+      for(int ax=0;ax<NUM_AXES;ax++)
+        target[ax] = AXES[ax].getStepsFromMM(arc_end[ax]);
+    }
+    else
+    {
+      float f = (float)arc_next / arc_segments;
+      float a = arc_angle + arc_sweep * f;
+      for(int ax=0;ax<NUM_AXES;ax++)
+        target[ax] = AXES[ax].getStepsFromMM(arc_start[ax] + (arc_end[ax] - arc_start[ax]) * f);
+      target[arc_axes[0]] = AXES[arc_axes[0]].getStepsFromMM(arc_center[0] + arc_radius * cos(a));
+      target[arc_axes[1]] = AXES[arc_axes[1]].getStepsFromMM(arc_center[1] + arc_radius * sin(a));
+    }
+    queueMove(target, gcode.linenum, feedin);
   }
 
-  // We want to carry over the previous ending position and feedrate if possible.
-  gcode.startpos = *lastend;
-  if(gcode[F].isUnused())
-    gcode.feed = feedin;
-  else
-    gcode.feed = gcode[F].getFloat();
+  arc_active = false;
+  return true;
+}
 
-  if(gcode.feed == 0)
-    gcode.feed = SAFE_DEFAULT_FEED;
 
+// Queues a move to target, unless it doesn't go anywhere.
+void Motion::queueMove(int32_t* target, int32_t linenum, float feed)
+{
+  MoveBlock& block = blocks.getNextWrite(0);
+  block.linenum = linenum;
+  block.feed = feed > 0xFFFF ? 0xFFFF : feed;
 
-  getMovesteps(gcode);
-  getActualEndpos(gcode);
+  precalc(block, target);
+  if(block.movesteps == 0)
+    return;
 
-  *lastend = gcode.endpos;
-  feedin  = gcode.feed;
-  gcode.state = GCode::PREPARED;
+  blocks.finishWrite();
+  replan = true;
+}
 
-  if(gcode.movesteps == 0)
-    return;
 
-  // Calculate actual distance of move along vector
-  gcode.actualmm  = 0;
+// Run all the math on a move from the end of the last one to target.
+void Motion::precalc(MoveBlock& block, int32_t* target)
+{
   for(int ax=0;ax<NUM_AXES;ax++)
   {
-    gcode.actualmm += pow(gcode.axismovesteps[ax]/AXES[ax].getStepsPerMM(), 2);
+    block.startpos[ax] = planpos[ax];
+    planpos[ax] = target[ax];
   }
-  gcode.actualmm = sqrt(gcode.actualmm);
+  getMovesteps(block, target);
+
+  if(block.movesteps == 0)
+    return;
 
-  float axisspeeds[NUM_AXES];
-  // Calculate individual axis movement speeds
-  float mult = gcode.feed/gcode.actualmm;
+  // Everything from here is integer math: axis lengths in microns, scaled down
+  // together so the sum of their squares fits in 32 bits.
+  uint32_t um[NUM_AXES];
+  uint32_t biggest = 0;
   for(int ax=0;ax<NUM_AXES;ax++)
   {
-    axisspeeds[ax] = (gcode.axismovesteps[ax] / AXES[ax].getStepsPerMM()) * mult;
-#ifdef DEBUG_LAME
-    HOST.labelnum("AS", ax, false);
-    HOST.labelnum(":", axisspeeds[ax]);
-#endif    
+    um[ax] = AXES[ax].getMicrons(block.axismovesteps[ax]);
+    if(um[ax] > biggest)
+      biggest = um[ax];
   }
-
-  // Calculate ratio of movement speeds to main axis
-  for(int ax=0;ax < NUM_AXES;ax++)
+  uint8_t shift = 0;
+  while((biggest >> shift) > 0x7FFF)
+    shift++;
+  uint32_t sum = 0;
+  for(int ax=0;ax<NUM_AXES;ax++)
   {
-    if(axisspeeds[ax] != 0)
-      gcode.axisratio[ax] = axisspeeds[gcode.leading_axis] / axisspeeds[ax];
-    else
-      gcode.axisratio[ax] = 0;
+    uint32_t d = um[ax] >> shift;
+    sum += d * d;
   }
-
-  // Check all axis for violation o top speed.  Take the biggest violator and change
-  // the leading axis speed to match it.
-  float bigdiff = 0;
-  float littlediff = 0;
+  uint32_t len  = isqrt32(sum);
+  uint32_t lead = um[block.leading_axis] >> shift;
+  if(len == 0)
+    len = 1;
+
+  // The lookahead still works in floats; leading axis feed / path feed.
+  block.leadratio = (float)lead / len;
+
+  uint32_t feed = block.feed;
+  // Leading axis feed for the requested path feed; then slow it down until no
+  // axis goes over its top speed, or its start speed for the jerk-free start.
+  uint32_t leadfeed  = feed * lead / len;
+  uint32_t maxfeed   = leadfeed;
+  uint32_t startfeed = leadfeed;
   for(int ax = 0;ax<NUM_AXES;ax++)
   {
-    if(axisspeeds[ax] > AXES[ax].getMaxFeed())
-    {
-      float d = (axisspeeds[ax] - AXES[ax].getMaxFeed()) * gcode.axisratio[ax];
+    uint32_t d = um[ax] >> shift;
+    if(d == 0)
+      continue;
+
+    uint32_t lim = AXES[ax].getMaxFeedInt() * lead / d;
+    if(lim < maxfeed)
+      maxfeed = lim;
+    lim = (AXES[ax].getStartFeedInt() / 2) * lead / d;
+    if(lim < startfeed)
+      startfeed = lim;
 #ifdef DEBUG_LAME
-      HOST.labelnum("D",ax,false);
-      HOST.labelnum(":",axisspeeds[ax] - AXES[ax].getMaxFeed(),false);
-      HOST.labelnum(" rat: ", gcode.axisratio[ax]);
-#endif      
+    HOST.labelnum("AS", ax, false);
+    HOST.labelnum(":", leadfeed * d / lead);
+#endif    
+  }
+#ifdef DEBUG_LAME
+  HOST.labelnum("MF:", maxfeed);
+  HOST.labelnum("SF:", startfeed);
+#endif
 
+  block.maxfeed = maxfeed;
+  block.startfeed = startfeed;
+  block.endfeed   = block.startfeed;
+  block.minfeed = block.startfeed;
 
-      if(d > bigdiff)
-        bigdiff = d;
-    }
+  // Accel is scaled like the speeds above: the leading axis accelerates no
+  // harder than lets every other axis in the move stay within its own.
+  Axis& leadaxis = AXES[block.leading_axis];
+  uint32_t accel = leadaxis.getAccelRate();
+  for(int ax = 0;ax<NUM_AXES;ax++)
+  {
+    uint32_t d = um[ax] >> shift;
+    if(d == 0 || ax == block.leading_axis)
+      continue;
 
-    if(axisspeeds[ax] > AXES[ax].getStartFeed()/2)
+    uint32_t lim = AXES[ax].getAccelRate() * lead / d;
+    if(lim < accel)
+      accel = lim;
+  }
+  // The S-curve's steepest point is 1.5x the straight ramp's slope, so plan
+  // it with 2/3 the accel; then it peaks at the configured rate.
+  block.scurve = scurve;
+  if(scurve)
+    accel = accel * 2 / 3;
+  if(accel == 0)
+    accel = 1;
+  block.accel = accel;
+  if(accel == leadaxis.getAccelRate())
+    block.accel_dist_scale = leadaxis.getAccelDistScale();
+  else
+  {
+    // The scale goes as 1/accel: the leading axis' own, times how many times
+    // gentler this move's accel is (Q16).
+    uint32_t full = leadaxis.getAccelRate();
+    uint32_t part = accel;
+    while(full > 0xFFFF)
     {
-      float d = (axisspeeds[ax] - (AXES[ax].getStartFeed()/2)) * gcode.axisratio[ax];
-      if(d > littlediff)
-        littlediff = d;
+      full >>= 1;
+      part >>= 1;
     }
+    if(part == 0)
+      part = 1;
+    uint32_t ratio = (full << 16) / part;
+    uint32_t scale = leadaxis.getAccelDistScale();
+    if(scale > 0xFFFFFFFFUL / ((ratio >> 16) + 1))
+      block.accel_dist_scale = 0xFFFFFFFF;
+    else
+      block.accel_dist_scale = mul_q16(scale, ratio);
   }
-#ifdef DEBUG_LAME
-  HOST.labelnum("BD:", bigdiff);
-  HOST.labelnum("LD:", littlediff);
-#endif
-
-  gcode.maxfeed = axisspeeds[gcode.leading_axis] - bigdiff;
-  gcode.startfeed = axisspeeds[gcode.leading_axis] - littlediff;
-  gcode.endfeed   = gcode.startfeed;
-  gcode.currentfeed = gcode.startfeed;
-  gcode.minfeed = gcode.startfeed;
-
-  // TODO: We shoudl treat accel as we do the speeds above and scale it to fit the chosen axis. 
-  // instead we just take the accel of the leadng axis.
-  float accel = AXES[gcode.leading_axis].getAccel();
-  gcode.accel = accel;
 
 
   for(int ax=0;ax<NUM_AXES;ax++)
   {
-    if(gcode.axismovesteps[ax])
+    if(block.axismovesteps[ax])
       AXES[ax].enable();
   }
 
 
 #ifdef DEBUG_LAME
- HOST.labelnum("F1: ", gcode.startfeed);
- HOST.labelnum("F2: ", gcode.maxfeed);
+ HOST.labelnum("F1: ", block.startfeed);
+ HOST.labelnum("F2: ", block.maxfeed);
  HOST.labelnum("Accel: ", accel);
 #endif
 
 
-  uint32_t dist = AXES[gcode.leading_axis].getAccelDist(gcode.startfeed, gcode.maxfeed, accel);
-  uint32_t halfmove = gcode.movesteps >> 1;
+  uint32_t dist = block.getAccelDist(block.startfeed, block.maxfeed);
+  uint32_t halfmove = block.movesteps >> 1;
   if(halfmove <= dist)
   {
-    gcode.accel_until = gcode.movesteps - halfmove;
-    gcode.decel_from  = halfmove;
+    block.accel_until = block.movesteps - halfmove;
+    block.decel_from  = halfmove;
   }
   else
   {
-    gcode.accel_until =  gcode.movesteps - dist;
-    gcode.decel_from  =  dist;
+    block.accel_until =  block.movesteps - dist;
+    block.decel_from  =  dist;
   }
 
-  gcode.currentinterval = AXES[gcode.leading_axis].interval_from_feedrate((float)gcode.startfeed * feed_modifier);
-  gcode.currentfeed = gcode.startfeed;
-
-  // TODO: this only changes when we change accel rates; can we just store it per-axis until we scale accels properly?
-  gcode.accel_inc   = (float)((float)accel * 60.0f / ACCELS_PER_SECOND);
-  gcode.accel_timer = ACCEL_INC_TIME;
+  block.accel_timer = ACCEL_INC_TIME;
 
-  gcode.optimized = false;
+  block.max_entry = 0;
+  setRates(block);
 
+  // Last, as the interrupt may pick it up from here on.
+  ATOMIC_BLOCK(ATOMIC_RESTORESTATE)
+  {
+    block.state = MoveBlock::PLANNED;
+  }
 }
 
 
-// Diverent moves need to be handled specially.
-// Divergent moves are ones where one axis is increasing in speed, while another is
-// decreasing.  This means if we blindly adjust one side, then the other, as we do, 
-// the second adjustment is likely to bring the first adjustment out of whack.
-// So here we basically limit speed to the maximum speed from which it's impossible to go out of whack.
-// TODO: Don't assume all diverence is on XY
-// this algorithm is crap.
-void Motion::fix_diverge(int32_t *ends, int32_t *starts)
-{
-    int32_t dA = labs(labs(ends[0]) - labs(ends[1]));
-    int32_t dB = labs(labs(starts[0]) - labs(starts[1]));
-    // max diverge is 2x jump - diff in other axis.
-    // .. or something like that.
-    //int32_t mdiv = (AXES[0].getStartFeed() * 2) - dB;
-    int32_t mdiv = AXES[0].getStartFeed()*2;
-    if(dB < AXES[0].getStartFeed())
-      mdiv -= dB;
-
-    if(dA > mdiv)
-    {
-      float ar     = (float)mdiv / (float)dA;
-
-      if(ar < 1)
-      {
-        for(int ax=0;ax<NUM_AXES;ax++)
-        {
-          ends[ax] = (float)ends[ax] * ar;
-        }
-#ifdef DEBUG_LAME
-      HOST.labelnum("divratio: ", ar);
-#endif  
-
-#ifdef DEBUG_LAME    
-      for(int ax=0;ax<NUM_AXES;ax++)
-      {
-        HOST.labelnum("DIV:[", ax, false);
-        HOST.labelnum("]:", ends[ax],false);
-        HOST.labelnum("->", starts[ax], false);
-        HOST.labelnum(" @jump:", AXES[ax].getStartFeed());
-      }
-#endif
-      }
-    }
-}
-
-
-// This is a routine that limits endspeed to a rate at which we can hit
-// start speeds.  Run it in reverse to limit the start speed to something we 
-// can hit from our end speed.
-bool Motion::join_moves(int32_t *ends, int32_t *starts)
+// Fastest the path can take the corner from move a into move b, in mm/min
+// along the path.
+// With a junction deviation set, this is the speed at which a circle that
+// deviates that far from the corner can be taken at the slower move's accel
+// (see Sonny Jeon's write-up for grbl); it only needs the angle between the
+// two moves.  Otherwise no axis may change speed by more than its start feed,
+// which is what we let an axis jump to from a standstill.
+float Motion::junction_feed(MoveBlock& a, MoveBlock& b)
 {
-  float ratio = 1;
+  float pa = a.maxfeed / a.leadratio;
+  float pb = b.maxfeed / b.leadratio;
+  float v = min(pa, pb);
+
+  // Directions and lengths both come from the step counts, so they agree, but
+  // float rounding can still leave |cos| just over 1.
+  float ma[NUM_AXES], mb[NUM_AXES];
+  float la = 0, lb = 0;
   for(int ax=0;ax<NUM_AXES;ax++)
   {
-    float ar = 1;
-    // The 0.75f in the next line is the shit part; it's there because
-    // it helps us guarantee we're within jerk after 4 iterations (see 
-    // unused diverge function above for explanation why) but it 
-    // obviouly means no move that is adjusted is going to be optimum.
-    uint32_t jump = (float)AXES[ax].getStartFeed() * 0.75f;
-    uint32_t desired = fabs(starts[ax]) + jump;
-
-    if((starts[ax] == 0) != (ends[ax] == 0))
-      desired = jump;
-    else if((starts[ax] > 0) != (ends[ax] > 0))
-      desired = jump/2;
-
-    ar = float(desired) / fabs(ends[ax]);
+    ma[ax] = (float)a.axismovesteps[ax] / AXES[ax].getStepsPerMM();
+    mb[ax] = (float)b.axismovesteps[ax] / AXES[ax].getStepsPerMM();
+    if(!a.isForward(ax)) ma[ax] = -ma[ax];
+    if(!b.isForward(ax)) mb[ax] = -mb[ax];
+    la += ma[ax] * ma[ax];
+    lb += mb[ax] * mb[ax];
+  }
+  la = sqrt(la);
+  lb = sqrt(lb);
 
-    if(ar < ratio)
+  // Stop at the corner if there's no direction to compare.
+  if(la <= 0 || lb <= 0)
+    v = 0;
+  else if(junction_deviation > 0)
+  {
+    float dot = 0;
+    for(int ax=0;ax<NUM_AXES;ax++)
+      dot += ma[ax] * mb[ax];
+    // cos of the angle the path turns through is dot/|a||b|; we want sin(half
+    // the angle between the moves), which is sqrt((1 + cos turn) / 2).
+    float cos_turn = dot / (la * lb);
+    if(cos_turn > 1.0f) cos_turn = 1.0f;
+    if(cos_turn < -1.0f) cos_turn = -1.0f;
+    float sin_half = sqrt(0.5f * (1.0f + cos_turn));
+    if(sin_half < 0.999f)
     {
-      ratio = ar;
+      float accel = min(a.accel / a.leadratio, b.accel / b.leadratio);
+      float jv = sqrt(accel * junction_deviation * sin_half / (1.0f - sin_half)) * 60.0f;
+      if(jv < v)
+        v = jv;
     }
   }
-  if(ratio < 1)
+  else
   {
     for(int ax=0;ax<NUM_AXES;ax++)
     {
-      ends[ax] = (float)ends[ax] * ratio;
+      float d = fabs(ma[ax] / la - mb[ax] / lb);
+      if(d * v > AXES[ax].getStartFeed())
+        v = AXES[ax].getStartFeed() / d;
     }
-    return true;
   }
-  return false;
+
+  // Anything that didn't come out as a real number means stop at the corner.
+  if(!(v >= 0 && v < 1e30f))
+    v = 0;
+
+  // Never plan a corner slower than either move could start from a stop.
+  float slowest = min(a.minfeed / a.leadratio, b.minfeed / b.leadratio);
+  return max(v, slowest);
 }
 
 
-// This is the lookahead algorithm.  From a high level, we simply 
-// limit our end speed and the next start speed to appropriate limits, 
-// then further limit them to a speed where reaching a stop is possible.
-void Motion::gcode_optimize(GCode& gcode, GCode& nextg)
+// This is the lookahead planner.  moves[] is a run of back to back G1 moves;
+// the first one's start speed is already committed (the move ahead of it is
+// running with a matching end speed, or it starts from rest) and the last one
+// has to be able to stop, since we don't know what comes after it.
+// The reverse pass finds the fastest each move may be entered and still slow
+// down in time for everything after it; the forward pass then limits that to
+// what each move can actually accelerate to, and lays out the accel curves.
+// Feeds in a MoveBlock are the leading axis' feed, so they're converted through path
+// feed (feed / leadratio) at each junction.
+void Motion::gcode_plan(MoveBlock** moves, uint8_t count)
 {
 #ifdef LOOKAHEAD
-  // THIS NEEDS SERIOUS REFACTORIN
-  if(gcode.optimized)
+  if(count == 0)
     return;
 
-  gcode.optimized = true;
-
-  // If this isn't a move, we have nothing to do.
-  if(gcode[G].isUnused() || gcode[G].getInt() != 1 || gcode.movesteps == 0)
-    return;
-
-  // If the NEXT gcode isn't a move, then we will just recomute our accels
-  // (assuming the previous move changed them during it's optimization)
-  if(nextg[G].isUnused() || nextg[G].getInt() != 1 || nextg.movesteps == 0)
-  {
-    computeAccel(gcode);
-    return;
-  }
-
-  // Calculate the requested speed of each axis at its peak during this move,
-  // including a direction sign.  TODO: We calculated this once already, maybe we can store it.
-  int32_t axisspeeds[NUM_AXES];
-  int32_t endspeeds[NUM_AXES];
-  int32_t nextspeeds[NUM_AXES];
-  int32_t startspeeds[NUM_AXES];
-  float mult1 = (float)gcode.maxfeed / gcode.actualmm;
-  float mult2 = (float)nextg.maxfeed / nextg.actualmm;
-  for(int ax=0;ax<NUM_AXES;ax++)
+  float entry[MOVE_BUFSIZE];
+  float exitfeed = moves[count-1]->minfeed;
+  for(int x=count-1;x>0;x--)
   {
-    axisspeeds[ax] = (float)((float)gcode.axismovesteps[ax] / AXES[ax].getStepsPerMM()) * mult1;
-    axisspeeds[ax] *= gcode.axisdirs[ax] ? 1 : -1;
-    endspeeds[ax] = axisspeeds[ax];
-    nextspeeds[ax] = (float)((float)nextg.axismovesteps[ax] / AXES[ax].getStepsPerMM()) * mult2;
-    nextspeeds[ax] *= nextg.axisdirs[ax] ? 1 : -1;
-    startspeeds[ax] = nextspeeds[ax];
+    MoveBlock& g = *moves[x];
+    if(g.max_entry == 0)
+      g.max_entry = junction_feed(*moves[x-1], g);
+
+    float v = AXES[g.leading_axis].getSpeedAtEnd(exitfeed, g.accel, g.movesteps);
+    if(v > g.max_entry * g.leadratio)
+      v = g.max_entry * g.leadratio;
+    if(v > g.maxfeed)
+      v = g.maxfeed;
+    entry[x] = v / g.leadratio;
+    exitfeed = entry[x] * moves[x-1]->leadratio;
   }
 
-  int32_t *ends, *starts, *temp;
-  ends = endspeeds;
-  starts = startspeeds;
-  // TODO this is stupid shit.
-  int MAX_OPTS = (float)AXES[0].getMaxFeed() / (float)AXES[0].getStartFeed();
-  if(MAX_OPTS < 4)
-    MAX_OPTS = 4;
-
-  int c;
-// this algorithm is crap.
-  for(c=0;c<MAX_OPTS;c++)
-  {
-    // Calculate the end speeds (of this move) we can use to meet the start speeds (of the next move).
-    if(!join_moves(ends,starts) && c >= 1)
-      break;
-    temp = ends;
-    ends = starts;
-    starts = temp;
-  }
-
-  for(int ax=0;ax<NUM_AXES;ax++)
+  // A move we've changed is handed back to the interrupt only once the move
+  // after it is claimed too; otherwise it could chain from the new end speed
+  // into the next move's old start speed.
+  MoveBlock* held = NULL;
+  float startfeed = moves[0]->startfeed;
+  for(int x=0;x<count;x++)
   {
-#ifdef DEBUG_OPT    
-  HOST.labelnum("OPTS:",c);
-    HOST.labelnum("ASP[", ax, false);
-    HOST.labelnum("]:", axisspeeds[ax],false);
-    HOST.labelnum("->", endspeeds[ax],false);
-    HOST.labelnum(", ", startspeeds[ax],false);
-    HOST.labelnum("->", nextspeeds[ax], false);
-    HOST.labelnum(" @jump:", AXES[ax].getStartFeed());
-#endif
-
-    if(labs(endspeeds[ax] - startspeeds[ax]) > AXES[ax].getStartFeed())
+    MoveBlock& g = *moves[x];
+    float endfeed = x+1 < count ? entry[x+1] * g.leadratio : g.minfeed;
+    if(endfeed > g.maxfeed)
+      endfeed = g.maxfeed;
+    float reach = AXES[g.leading_axis].getSpeedAtEnd(startfeed, g.accel, g.movesteps);
+    if(endfeed > reach)
+      endfeed = reach;
+
+    // Once the interrupt has started a move its speeds are fixed, and the
+    // next move has to start from whatever that one ends at.
+    bool claimed = false;
+    if(g.startfeed != (uint32_t)startfeed || g.endfeed != (uint32_t)endfeed)
     {
-      if(labs(endspeeds[ax] - startspeeds[ax]) - AXES[ax].getStartFeed() > (float)AXES[ax].getStartFeed())
+      ATOMIC_BLOCK(ATOMIC_RESTORESTATE)
       {
-#ifdef DEBUG_JUMP    
-        HOST.labelnum("JUMP EXCEED LINE ", gcode.linenum);
-#endif
-        endspeeds[gcode.leading_axis] = AXES[gcode.leading_axis].getStartFeed() / 2;
-        startspeeds[nextg.leading_axis] = AXES[nextg.leading_axis].getStartFeed() / 2;
+        if(g.state == MoveBlock::PLANNED)
+        {
+          g.state = MoveBlock::REPLANNING;
+          claimed = true;
+        }
       }
     }
+    if(held)
+    {
+      ATOMIC_BLOCK(ATOMIC_RESTORESTATE)
+      {
+        held->state = MoveBlock::PLANNED;
+      }
+      held = NULL;
+    }
+    if(claimed)
+    {
+      g.startfeed = startfeed;
+      g.endfeed = endfeed;
+      computeAccel(g);
+      setRates(g);
+      held = &g;
+    }
+    if(x+1 < count)
+      startfeed = g.endfeed / g.leadratio * moves[x+1]->leadratio;
   }
-
-  // Speed at which the next move's leading axis can reach 0 during the next move.
-  float speedto0 = AXES[nextg.leading_axis].
-                    getSpeedAtEnd(AXES[nextg.leading_axis].getStartFeed()/2,
-                                  nextg.accel, 
-                                  nextg.movesteps);
-
-  // NOT TODO: startspeeds/endspeeds is signed previous to this operation but unsigned
-  // after.  Not important, though.
-
-  // If the next move cannot reach 0, limit it so it can.
-  if(speedto0 < labs(startspeeds[nextg.leading_axis]))
-  {
-#ifdef DEBUG_LAME
-    HOST.labelnum("st0beg:",speedto0);
-    HOST.labelnum("beg:",startspeeds[nextg.leading_axis]);
-#endif
-    startspeeds[nextg.leading_axis] = speedto0;
-  }
-    
-  // now speedto0 is the maximum speed the primary in the next move can be going.  We need the equivalent speed of the primary in this move.
-  speedto0 = (speedto0 * gcode.axisratio[nextg.leading_axis]);
-  // If this move isn't moving the primary of the next move, then speedto0 will come out to 0.
-  // This is obviously incorrect...
-  if(speedto0 < labs(endspeeds[gcode.leading_axis]))
+  if(held)
   {
-#ifdef DEBUG_LAME
-    HOST.labelnum("st0end:",speedto0);
-    HOST.labelnum("end:",endspeeds[gcode.leading_axis]);
-#endif
-    endspeeds[gcode.leading_axis] = speedto0;
+    ATOMIC_BLOCK(ATOMIC_RESTORESTATE)
+    {
+      held->state = MoveBlock::PLANNED;
+    }
   }
-
-#ifdef DEBUG_LAME
-    HOST.labelnum("ef: ", gcode.endfeed, false);
-    HOST.labelnum("sf: ", gcode.startfeed, false);
-#endif    
-
-  gcode.endfeed = max(gcode.endfeed,labs(endspeeds[gcode.leading_axis]));
-  nextg.startfeed = max(nextg.startfeed,labs(startspeeds[nextg.leading_axis]));
-  // because we only lookahead one move, our maximum exit speed has to be either the desired
-  // exit speed or the speed that the next move can reach to 0 (0+jerk, actually) during.
-
-  computeAccel(gcode, &nextg);
-
 #endif // LOOKAHEAD
 }
 
 
 // This computes an acceleration curve, given requested start, max, and end speeds for a move.
-// Optimally, also pass the next move, and it will adjust the start speed there to match the
-// actual speeds we can achieve < max.
-void Motion::computeAccel(GCode& gcode, GCode* nextg)
+void Motion::computeAccel(MoveBlock& block)
 {
-  if(gcode[G].isUnused() || gcode[G].getInt() != 1)
+  if(block.movesteps == 0)
     return;
 
-  if(gcode.movesteps == 0)
-    return;
-
-  if(gcode.startfeed < gcode.minfeed) // Optimization might have accidentally lowered us past this point.
-    gcode.startfeed = gcode.minfeed;
+  if(block.startfeed < block.minfeed) // Optimization might have accidentally lowered us past this point.
+    block.startfeed = block.minfeed;
 
   // Two cases:
   // 1) start speed < end speed; we get to accelerate for free up to end.
   // 2) start speed >= end speed; we must plan decel irst, then add in appropriate accel.
-  if(gcode.startfeed < gcode.endfeed)
+  if(block.startfeed < block.endfeed)
   {
-    uint32_t distance_to_end = AXES[gcode.leading_axis].getAccelDist(gcode.startfeed, gcode.endfeed, gcode.accel);
-    uint32_t distance_to_max = AXES[gcode.leading_axis].getAccelDist(gcode.startfeed, gcode.maxfeed, gcode.accel);
+    uint32_t distance_to_end = block.getAccelDist(block.startfeed, block.endfeed);
+    uint32_t distance_to_max = block.getAccelDist(block.startfeed, block.maxfeed);
     // start is less than end, and we cannot accelerate enough to make the end in time.
-    if(distance_to_end >= gcode.movesteps)
+    if(distance_to_end >= block.movesteps)
     {
-      gcode.decel_from = 0;
-      gcode.accel_until = 0;
+      block.decel_from = 0;
+      block.accel_until = 0;
       // TODO: fix - should be speed we will reach + jerk
-      gcode.endfeed = AXES[gcode.leading_axis].getSpeedAtEnd(gcode.startfeed, gcode.accel, gcode.movesteps);
-      if(nextg != NULL)
-        nextg->startfeed = gcode.endfeed / nextg->axisratio[gcode.leading_axis];
+      block.endfeed = AXES[block.leading_axis].getSpeedAtEnd(block.startfeed, block.accel, block.movesteps);
     }
     else // start is less than end, and we have extra room to accelerate.
     {
-      uint32_t halfspace = (gcode.movesteps - distance_to_end)/2;
+      uint32_t halfspace = (block.movesteps - distance_to_end)/2;
       distance_to_max -= distance_to_end;
       if(distance_to_max <= halfspace)
       {
         // Plateau
-        gcode.accel_until = gcode.movesteps - distance_to_end - distance_to_max;
-        gcode.decel_from  = distance_to_max;
+        block.accel_until = block.movesteps - distance_to_end - distance_to_max;
+        block.decel_from  = distance_to_max;
       }
       else
       {
         // Peak
-        gcode.accel_until = gcode.movesteps - distance_to_end - halfspace;
-        gcode.decel_from  = halfspace;
+        block.accel_until = block.movesteps - distance_to_end - halfspace;
+        block.decel_from  = halfspace;
       }
     }
   }
   else // start speed >= end speed... must decelrate primarily, accel if time.
   {
-    uint32_t distance_to_end = AXES[gcode.leading_axis].getAccelDist(gcode.endfeed, gcode.startfeed, gcode.accel);
-    uint32_t distance_to_max = AXES[gcode.leading_axis].getAccelDist(gcode.startfeed, gcode.maxfeed, gcode.accel);
-    if(distance_to_end >= gcode.movesteps)
+    uint32_t distance_to_end = block.getAccelDist(block.endfeed, block.startfeed);
+    uint32_t distance_to_max = block.getAccelDist(block.startfeed, block.maxfeed);
+    if(distance_to_end >= block.movesteps)
     {
       // TODO: this is NOT GOOD.  Throw an error.
 #ifdef DEBUG_ACCEL
-      HOST.labelnum("TOO FAST! ", gcode.movesteps, false);
+      HOST.labelnum("TOO FAST! ", block.movesteps, false);
       HOST.labelnum(", needs ", distance_to_end, false);
-      HOST.labelnum(" at ", gcode.accel, false);
-      HOST.labelnum(" - ", gcode.startfeed, false);
-      HOST.labelnum(" - ", gcode.endfeed);
+      HOST.labelnum(" at ", block.accel, false);
+      HOST.labelnum(" - ", block.startfeed, false);
+      HOST.labelnum(" - ", block.endfeed);
 #endif      
-      gcode.decel_from = gcode.movesteps;
-      gcode.accel_until = gcode.movesteps;
+      block.decel_from = block.movesteps;
+      block.accel_until = block.movesteps;
       // TODO: fix - should be speed we will reach + jerk
-      gcode.endfeed = AXES[gcode.leading_axis].getSpeedAtEnd(gcode.startfeed, -gcode.accel, gcode.movesteps);
-      if(nextg != NULL)
-        nextg->startfeed = max(gcode.endfeed * nextg->axisratio[gcode.leading_axis], nextg->startfeed);
+      block.endfeed = AXES[block.leading_axis].getSpeedAtEnd(block.startfeed, -block.accel, block.movesteps);
     }
     else  // lots of room to decelerate
     {
-      uint32_t halfspace = (gcode.movesteps - distance_to_end)/2;
+      uint32_t halfspace = (block.movesteps - distance_to_end)/2;
       if(distance_to_max <= halfspace)
       {
         // Plateau
-        gcode.accel_until = gcode.movesteps - distance_to_max;
-        gcode.decel_from  = distance_to_max + distance_to_end;
+        block.accel_until = block.movesteps - distance_to_max;
+        block.decel_from  = distance_to_max + distance_to_end;
       }
       else
       {
         // Peak
-        gcode.accel_until = gcode.movesteps - halfspace;
-        gcode.decel_from  = halfspace + distance_to_end;
+        block.accel_until = block.movesteps - halfspace;
+        block.decel_from  = halfspace + distance_to_end;
       }
     }
   }
 
-  gcode.currentinterval = AXES[gcode.leading_axis].interval_from_feedrate((float)gcode.startfeed * feed_modifier);
-  gcode.currentfeed = gcode.startfeed;
+#ifdef DEBUG_ACCEL    
+  HOST.labelnum("lines:",block.linenum,false);
+  HOST.labelnum(" steps:", block.movesteps,false);
+  HOST.labelnum(" au1:", block.accel_until,false);
+  HOST.labelnum(" df1:", block.decel_from,false);
+  HOST.labelnum(" attain: ", AXES[block.leading_axis].getSpeedAtEnd(block.startfeed, block.accel, block.movesteps-block.accel_until), false);
+  HOST.labelnum(" start: ", block.startfeed, false);
+  HOST.labelnum(" max: ", block.maxfeed, false);
+  HOST.labelnum(" end: ", block.endfeed);
+#endif
+}
 
-  if(nextg != NULL && nextg->startfeed > nextg->maxfeed)
-    nextg->startfeed = nextg->maxfeed;
 
-#ifdef DEBUG_ACCEL    
-  HOST.labelnum("lines:",gcode.linenum,false);
-  if(nextg != NULL)
-    HOST.labelnum("-",nextg->linenum,false);
-  HOST.labelnum(" steps:", gcode.movesteps,false);
-  HOST.labelnum(" au1:", gcode.accel_until,false);
-  HOST.labelnum(" df1:", gcode.decel_from,false);
-  HOST.labelnum(" attain: ", AXES[gcode.leading_axis].getSpeedAtEnd(gcode.startfeed, gcode.accel, gcode.movesteps-gcode.accel_until), false);
-  HOST.labelnum(" start: ", gcode.startfeed, false);
-  HOST.labelnum(" max: ", gcode.maxfeed, false);
-  HOST.labelnum(" end: ", gcode.endfeed, false);
-  if(nextg != NULL)
-  {
-    HOST.labelnum(" nextstart: ", nextg->startfeed, false);
-    HOST.labelnum(" nextmax: ", nextg->maxfeed,false);
-    HOST.labelnum(" nextsteps:", nextg->movesteps,false);
-    HOST.labelnum(" au2:", nextg->accel_until,false);
-    HOST.labelnum(" df2:", nextg->decel_from);
-  }
-  else
-  {
-    HOST.write(" - unopt.\n");
-  }
+void Motion::setRates(MoveBlock& block)
+{
+  // The interrupt accelerates in step rates so it never has to touch a float.
+  Axis& lead = AXES[block.leading_axis];
+  block.currentrate = lead.rate_from_feedrate(block.startfeed);
+  block.maxrate     = lead.rate_from_feedrate(block.maxfeed);
+  block.endrate     = lead.rate_from_feedrate(block.endfeed);
+  block.rate_inc    = lead.rate_from_feedrate(block.accel * 60.0f / ACCELS_PER_SECOND);
+  if(block.rate_inc == 0)
+    block.rate_inc = 1;
+
+#ifdef LINEAR_ADVANCE_K
+  // Only while printing; travel and retracts let the advance back off.
+  block.advance_scale = 0;
+  if(advance_k > 0 && block.isForward(E) && block.axismovesteps[E] && block.leading_axis != E)
+    block.advance_scale = advance_k * 65536.0f * block.axismovesteps[E] / block.movesteps;
 #endif
+
+  if(!block.scurve)
+    return;
+
+  // The S-curve needs to know where the accel ramp tops out.
+  float peak = block.startfeed;
+  if(block.accel_until < block.movesteps)
+    peak = lead.getSpeedAtEnd(block.startfeed, block.accel, block.movesteps - block.accel_until);
+  if(peak > block.maxfeed)
+    peak = block.maxfeed;
+  block.startrate    = block.currentrate;
+  block.peakrate     = lead.rate_from_feedrate(peak);
+  if(block.peakrate < block.startrate)
+    block.peakrate = block.startrate;
+  block.decel_base   = 0;
+  block.ramp_u       = 0;
+  block.accel_u_step = ramp_ticks_step(block.startrate, block.peakrate, block.rate_inc);
 }
 
+// How far through an S-curve ramp each accel tick gets, Q16; the ramp takes
+// as many ticks as the trapezoid would to go from one rate to the other.
+// Once per ramp, so the divide is OK in the interrupt.
+uint16_t Motion::ramp_ticks_step(uint32_t from, uint32_t to, uint32_t inc)
+{
+  uint32_t ticks = to > from ? (to - from) / inc : 0;
+  if(ticks == 0)
+    return 0xFFFF;
+  if(ticks > 0xFFFF)
+    return 1;
+  return 0xFFFF / ticks;
+}
 
-// Takes the next queued gcode and begins running it.
-void Motion::gcode_execute(GCode& gcode)
+// Rate u (Q16) of the way along an S-curve between two rates; the curve is
+// 3u^2 - 2u^3, which eases out of one speed and into the other.  In the
+// interrupt, so 16-bit multiplies only.
+uint32_t Motion::scurve_rate(uint32_t from, uint32_t to, uint32_t u)
 {
-  // Only execute codes that are prepared.
-  if(gcode.state < GCode::PREPARED)
-    return; // TODO: This should never happen now and is an error.
-  // Don't execute codes that are ACTIVE or DONE (ACTIVE get handled by interrupt)
-  if(gcode.state > GCode::PREPARED)
+  uint32_t q = u >= 0xFFFF ? 256 : u >> 8;
+  uint32_t s = (q * q * (768 - 2 * q)) >> 16;
+  if(to > from)
+    return from + ((to - from) >> 8) * s;
+  return from - ((from - to) >> 8) * s;
+}
+
+// Takes the next queued move and begins running it, when the steppers are idle.
+void Motion::startMove(MoveBlock& block)
+{
+  // Don't start moves that are ACTIVE or DONE (ACTIVE get handled by interrupt)
+  if(block.state != MoveBlock::PLANNED)
     return;
 
-  // Make sure they have configured the axis!
-  if(AXES[0].isInvalid())
+  if(block.movesteps == 0)
   {
-    Host::Instance(gcode.source).write_P(PSTR("!! AXIS ARE NOT CONFIGURED !!\n"));
-    gcode.state = GCode::DONE;
+    block.state = MoveBlock::DONE;
     return;
   }
 
-  if(gcode.movesteps == 0)
-  {
-    gcode.state = GCode::DONE;
+  if(!loadMove(block))
     return;
-  }
+#ifdef STEP_DIR_DELAY_US
+  // The compare will have come round while we sat idle, so the first step is
+  // taken the moment the interrupt goes on; give the DIR just set its time.
+  _delay_us(STEP_DIR_DELAY_US);
+#endif
+  enableInterrupt();
+}
 
-  // Prepare axis move data -- Invalidate all precomputes if bad data (happens on hitting an endstop)
+// Hands a move to the interrupt.  Runs in the interrupt when chaining moves,
+// so no floats in here.
+bool Motion::loadMove(MoveBlock& block)
+{
+  // Prepare axis move data -- if an endstop cut the last move short we aren't where this
+  // move starts, and handlenext has to rebase it.
   for(int ax=0;ax<NUM_AXES;ax++)
   {
-    if(!AXES[ax].setupMove(gcode.startpos[ax], gcode.axisdirs[ax], gcode.axismovesteps[ax]))
+    if(!AXES[ax].setupMove(block.startpos[ax], block.isForward(ax), block.axismovesteps[ax]))
     {
-      GCODES.Invalidate();
-      // We'll get back here after the first move is recomputed.
-      return;
+      invalidate_moves = true;
+      // We'll get back here once handlenext has rebased it.
+      return false;
     }
-    deltas[ax] = gcode.axismovesteps[ax];
-    errors[ax] = gcode.movesteps >> 1;
+    deltas[ax] = block.axismovesteps[ax];
+    errors[ax] = block.movesteps >> 1;
   }
 
+  block.currentinterval = interval_from_rate(block.currentrate);
+
+#ifdef STEP_TRACE
+  trace_dirs = block.axisdirs;
+  uint32_t accel = block.movesteps - block.accel_until;
+  steptrace::add(steptrace::MOVE_LINE, block.leading_axis, block.linenum);
+  steptrace::add(steptrace::MOVE_ACCEL, block.leading_axis, accel > 0xFFFF ? 0xFFFF : accel);
+  steptrace::add(steptrace::MOVE_DECEL, block.leading_axis, block.decel_from > 0xFFFF ? 0xFFFF : block.decel_from);
+#endif
+
   // setup pointer to current move data for interrupt
-  gcode.state = GCode::ACTIVE;
-  current_gcode = &gcode;
+  block.state = MoveBlock::ACTIVE;
+  current_block = &block;
+  advanceTarget();
 
-  setInterruptCycles(gcode.currentinterval);
-  enableInterrupt();
+  setInterruptCycles(block.currentinterval);
+  return true;
+}
+
+// Called from the interrupt as a move finishes: if the one after it in the
+// queue is planned, start it now instead of waiting on the mainloop, which
+// may be busy with SD or LCD for a while.
+bool Motion::chainMove()
+{
+  MoveBlock* next = (MoveBlock*)current_block + 1;
+  if(next == blocks_buf + MOVE_BUFSIZE)
+    next = blocks_buf;
+
+  if(next->state == MoveBlock::REPLANNING)
+    underruns++;
+  if(next->state != MoveBlock::PLANNED || GCODES.isPaused())
+    return false;
+
+  return loadMove(*next);
 }
 
 bool Motion::axesAreMoving() 
@@ -801,8 +1116,165 @@ void Motion::writePositionToHost(GCode& gc)
 }
 
 
+// Step interval in cycles for a leading axis step rate (steps/sec << 8), scaled
+// by the feed modifier.  This runs in the interrupt on every accel tick, so it
+// sticks to integer math and Marlin's table of F_CPU/8 timer ticks per step
+// rate.  Below 32 steps/sec there's time enough to divide.
+uint32_t Motion::interval_from_rate(uint32_t rate)
+{
+  uint32_t steprate = ((rate >> 8) * feed_scale) >> 8;
+  if(steprate < 32)
+    return steprate ? F_CPU / steprate : F_CPU;
+  if(steprate > 0xFFFF)
+    steprate = 0xFFFF;
+
+  uint16_t sr = steprate - 32;
+  uint16_t timer;
+  if(sr >= 8*256)
+  {
+    const uint16_t* e = speed_lookuptable_fast[sr >> 8];
+    timer = pgm_read_word(e) - (((uint32_t)pgm_read_word(e+1) * (uint8_t)sr) >> 8);
+  }
+  else
+  {
+    const uint16_t* e = speed_lookuptable_slow[sr >> 3];
+    timer = pgm_read_word(e) - (((uint32_t)pgm_read_word(e+1) * (sr & 7)) >> 3);
+  }
+  return (uint32_t)timer << 3;
+}
+
+
 // SJFW's main movement routine in some sense; this is executed by the processor
 // for each step of the primary axis in a movement.
+// Sorts the step pins by port for pulseSteps(); call when they change.
+void Motion::groupStepPins()
+{
+#ifdef GROUP_STEP_PULSES
+  step_groups = 0;
+  for(int ax=0;ax<NUM_AXES;ax++)
+  {
+    Pin& p = AXES[ax].getStepPin();
+    step_group[ax] = 0;
+    step_mask[ax] = 0;
+    step_pulse[ax] = 0;
+    if(p.isNull())
+      continue;
+    uint8_t g = 0;
+    while(g < step_groups && step_ports[g] != p.getPortIndex())
+      g++;
+    if(g == step_groups)
+      step_ports[step_groups++] = p.getPortIndex();
+    step_group[ax] = g;
+    step_mask[ax] = _BV(p.getPinIndex());
+  }
+#endif
+}
+
+// Board configs with FIXED_STEP_PINS name the step and endstop pins as types,
+// which saves going through Pin's port pointer on every step.
+inline bool Motion::takeStep(uint8_t axis)
+{
+#ifdef FIXED_STEP_PINS
+  switch(axis)
+  {
+    case 0: return AXES[0].takeStep<X_MIN_FIXED, X_MAX_FIXED>();
+    case 1: return AXES[1].takeStep<Y_MIN_FIXED, Y_MAX_FIXED>();
+    case 2: return AXES[2].takeStep<Z_MIN_FIXED, Z_MAX_FIXED>();
+    case 3: return AXES[3].takeStep<A_MIN_FIXED, A_MAX_FIXED>();
+  }
+#endif
+  return AXES[axis].takeStep();
+}
+
+inline void Motion::stepAxis(uint8_t axis)
+{
+#if defined(GROUP_STEP_PULSES)
+  if(takeStep(axis))
+    step_pulse[step_group[axis]] |= step_mask[axis];
+#elif defined(FIXED_STEP_PINS)
+  switch(axis)
+  {
+    case 0: AXES[0].doStep<X_STEP_FIXED, X_MIN_FIXED, X_MAX_FIXED>(); break;
+    case 1: AXES[1].doStep<Y_STEP_FIXED, Y_MIN_FIXED, Y_MAX_FIXED>(); break;
+    case 2: AXES[2].doStep<Z_STEP_FIXED, Z_MIN_FIXED, Z_MAX_FIXED>(); break;
+    case 3: AXES[3].doStep<A_STEP_FIXED, A_MIN_FIXED, A_MAX_FIXED>(); break;
+  }
+#else
+  if(AXES[axis].doStep())
+    steps_raised |= _BV(axis);
+#endif
+}
+
+// Raise every step pin stepAxis() marked, one port at a time, or without
+// GROUP_STEP_PULSES take the ones it raised as it went.  Then hold them for
+// STEP_PULSE_US and lower them all.
+inline void Motion::pulseSteps()
+{
+#ifdef GROUP_STEP_PULSES
+  uint8_t g;
+  for(g=0;g<step_groups;g++)
+  {
+    if(step_pulse[g])
+      _SFR_MEM8(step_ports[g]+2) |= step_pulse[g];
+  }
+#endif
+#ifdef STEP_PULSE_US
+  _delay_us(STEP_PULSE_US);
+#endif
+#if defined(GROUP_STEP_PULSES)
+  for(g=0;g<step_groups;g++)
+  {
+    if(step_pulse[g])
+      _SFR_MEM8(step_ports[g]+2) &= ~step_pulse[g];
+    step_pulse[g] = 0;
+  }
+#elif defined(FIXED_STEP_PINS)
+  // Single cbi's; quicker than checking which went up.
+  Axis::endStep<X_STEP_FIXED>();
+  Axis::endStep<Y_STEP_FIXED>();
+  Axis::endStep<Z_STEP_FIXED>();
+  Axis::endStep<A_STEP_FIXED>();
+#else
+  for(uint8_t a=0;a<NUM_AXES;a++)
+  {
+    if(steps_raised & _BV(a))
+      AXES[a].endStep();
+  }
+  steps_raised = 0;
+#endif
+}
+
+// Linear advance: the extruder should be ahead of the plan by K seconds of its
+// speed.  advanceTarget() works that out whenever the speed changes, and
+// advanceExtruder() makes up the difference with extra steps, no faster than
+// the leading axis is stepping.
+inline void Motion::advanceTarget()
+{
+#ifdef LINEAR_ADVANCE_K
+  uint32_t steprate = ((current_block->currentrate >> 8) * feed_scale) >> 8;
+  advance_target = mul_q16(steprate, current_block->advance_scale);
+#endif
+}
+
+inline void Motion::advanceExtruder()
+{
+#ifdef LINEAR_ADVANCE_K
+  for(uint8_t x=0;x<stepsdone && advance_steps != advance_target;x++)
+  {
+    if(advance_steps < advance_target)
+    {
+      AXES[E].advanceStep(true);
+      advance_steps++;
+    }
+    else
+    {
+      AXES[E].advanceStep(false);
+      advance_steps--;
+    }
+  }
+#endif
+}
+
 void Motion::handleInterrupt()
 {
   // This shouldn't be necessary if I've managed things properly, but I doubt I have.
@@ -827,81 +1299,138 @@ void Motion::handleInterrupt()
     return;
   }
 
-  if(current_gcode->movesteps == 0)
+  if(current_block->movesteps == 0)
   {
     disableInterrupt();
-    current_gcode->state = GCode::DONE;
+    current_block->state = MoveBlock::DONE;
     busy=false;
     return;
   }
 
-  current_gcode->movesteps--;
-
-  // Bresenham-style axis alignment algorithm
-  for(ax=0;ax<NUM_AXES;ax++)
+  // At high step rates we take several steps per interrupt; see setInterruptCycles.
+  for(stepsdone=0;stepsdone < stepsPerInterrupt && current_block->movesteps > 0;stepsdone++)
   {
-    if(ax == current_gcode->leading_axis)
-    {
-      AXES[ax].doStep();
-      continue;
-    }
+#ifdef STEP_PULSE_US
+    // The last step's pins have only just gone low; give the drivers their
+    // low time before the next.  Single steps are an interrupt apart anyway.
+    if(stepsdone)
+      _delay_us(STEP_PULSE_US);
+#endif
+    current_block->movesteps--;
 
-    errors[ax] = errors[ax] - deltas[ax];
-    if(errors[ax] < 0)
+    // Bresenham-style axis alignment algorithm
+    for(ax=0;ax<NUM_AXES;ax++)
     {
-      AXES[ax].doStep();
-      errors[ax] = errors[ax] + deltas[current_gcode->leading_axis];
+      if(ax == current_block->leading_axis)
+      {
+        stepAxis(ax);
+#ifdef STEP_TRACE
+        trace_steps += 1 << (ax << 2);
+#endif
+        continue;
+      }
+
+      errors[ax] = errors[ax] - deltas[ax];
+      if(errors[ax] < 0)
+      {
+        stepAxis(ax);
+#ifdef STEP_TRACE
+        trace_steps += 1 << (ax << 2);
+#endif
+        errors[ax] = errors[ax] + deltas[current_block->leading_axis];
+      }
     }
+    pulseSteps();
   }
 
+#ifdef STEP_TRACE
+  uint32_t us = trace_period / cyclesPerMicro();
+  steptrace::add(trace_dirs, trace_steps, us > 0xFFFF ? 0xFFFF : us);
+  trace_steps = 0;
+#endif
+
 
   accelsteps = 0;
-  current_gcode->accel_timer += current_gcode->currentinterval;
+  current_block->accel_timer += current_block->currentinterval * stepsdone;
   // Handle acceleration and deceleration
-  while(current_gcode->accel_timer > ACCEL_INC_TIME)
+  while(current_block->accel_timer > ACCEL_INC_TIME)
   {
-    current_gcode->accel_timer -= ACCEL_INC_TIME;
+    current_block->accel_timer -= ACCEL_INC_TIME;
     accelsteps++;
   }
 
-  if(accelsteps)
+  if(accelsteps && current_block->scurve)
   {
-    if(current_gcode->movesteps >= current_gcode->accel_until && current_gcode->currentfeed < current_gcode->maxfeed)
+    if(current_block->movesteps >= current_block->accel_until && current_block->currentrate < current_block->peakrate)
+    {
+      current_block->ramp_u += (uint32_t)current_block->accel_u_step * accelsteps;
+      current_block->currentrate = scurve_rate(current_block->startrate, current_block->peakrate, current_block->ramp_u);
+      current_block->currentinterval = interval_from_rate(current_block->currentrate);
+      setInterruptCycles(current_block->currentinterval);
+    }
+    else if(current_block->movesteps <= current_block->decel_from && current_block->currentrate > current_block->endrate)
+    {
+      if(current_block->decel_base == 0)
+      {
+        // Accel may not have topped out where the planner thought; time the
+        // ramp from the speed we actually have so it still ends on endrate.
+        current_block->decel_base = current_block->currentrate;
+        current_block->decel_u_step = ramp_ticks_step(current_block->endrate, current_block->currentrate, current_block->rate_inc);
+        current_block->ramp_u = 0;
+      }
+      current_block->ramp_u += (uint32_t)current_block->decel_u_step * accelsteps;
+      current_block->currentrate = scurve_rate(current_block->decel_base, current_block->endrate, current_block->ramp_u);
+      current_block->currentinterval = interval_from_rate(current_block->currentrate);
+      setInterruptCycles(current_block->currentinterval);
+    }
+  }
+  else if(accelsteps)
+  {
+    if(current_block->movesteps >= current_block->accel_until && current_block->currentrate < current_block->maxrate)
     { 
-      current_gcode->currentfeed += current_gcode->accel_inc * accelsteps;
+      current_block->currentrate += current_block->rate_inc * accelsteps;
 
-      if(current_gcode->currentfeed > current_gcode->maxfeed)
-        current_gcode->currentfeed = current_gcode->maxfeed;
+      if(current_block->currentrate > current_block->maxrate)
+        current_block->currentrate = current_block->maxrate;
 
-      current_gcode->currentinterval = AXES[current_gcode->leading_axis].interval_from_feedrate((float)(current_gcode->currentfeed) * feed_modifier);
+      current_block->currentinterval = interval_from_rate(current_block->currentrate);
 
-      setInterruptCycles(current_gcode->currentinterval);
+      setInterruptCycles(current_block->currentinterval);
     }
-    else if(current_gcode->movesteps <= current_gcode->decel_from && current_gcode->currentfeed > current_gcode->endfeed)
+    else if(current_block->movesteps <= current_block->decel_from && current_block->currentrate > current_block->endrate)
     { 
-      current_gcode->currentfeed -= current_gcode->accel_inc * accelsteps;
-
-      if(current_gcode->currentfeed < current_gcode->endfeed)
-        current_gcode->currentfeed = current_gcode->endfeed;
+      if(current_block->currentrate - current_block->endrate > current_block->rate_inc * accelsteps)
+        current_block->currentrate -= current_block->rate_inc * accelsteps;
+      else
+        current_block->currentrate = current_block->endrate;
 
-      current_gcode->currentinterval = AXES[current_gcode->leading_axis].interval_from_feedrate((float)(current_gcode->currentfeed) * feed_modifier);
+      current_block->currentinterval = interval_from_rate(current_block->currentrate);
 
-      setInterruptCycles(current_gcode->currentinterval);
+      setInterruptCycles(current_block->currentinterval);
     }
 
   }
 
+  if(accelsteps)
+    advanceTarget();
+  advanceExtruder();
+
   // This check is only important if we hit endstops; lets us know all the involved axis
   // have reached their end early.
   if(!axesAreMoving())
   {
-    current_gcode->movesteps = 0;
+    current_block->movesteps = 0;
   }
       
-  if(current_gcode->movesteps == 0)
+  if(current_block->movesteps == 0)
   {
-    disableInterrupt();
-    current_gcode->state = GCode::DONE;
+    current_block->state = MoveBlock::DONE;
+    if(!chainMove())
+      disableInterrupt();
+#ifdef INTERRUPT_STEPS
+    else
+      enableInterrupt();
+#endif
   }
 #ifdef INTERRUPT_STEPS
   else
@@ -962,10 +1491,23 @@ void Motion::disableInterrupt()
 
 // With a 16-bit timer operating at 1:1 with the clock,
 // we have to verflow at 0xFFFF, thus the 60000 check below.
+// cycles is the time between steps; below MULTISTEP_INTERVAL we double up
+// steps per interrupt (up to 8) and the interrupt interval along with them.
 void Motion::setInterruptCycles(unsigned long cycles) 
 {
   ATOMIC_BLOCK(ATOMIC_RESTORESTATE)
   {
+#ifdef MULTISTEP_INTERVAL
+    stepsPerInterrupt = 1;
+    while(cycles < MULTISTEP_INTERVAL && stepsPerInterrupt < 8)
+    {
+      cycles <<= 1;
+      stepsPerInterrupt <<= 1;
+    }
+#endif
+#ifdef STEP_TRACE
+    trace_period = cycles;
+#endif
     if(cycles > 60000)
     {
       OCR1A = 60000;
@@ -983,5 +1525,6 @@ void Motion::setInterruptCycles(unsigned long cycles)
 
 ISR(TIMER1_COMPA_vect)
 {
+  PROFILE_ISR(STEP);
   MOTION.handleInterrupt();
 }
@@ -7,8 +7,16 @@
 
 #include "config.h"
 #include "GCode.h"
+#include "MoveBlock.h"
+#include "RingBuffer.h"
 #include "Axis.h"
 
+// Boards with FIXED_STEP_PINS set each step pin with its own sbi/cbi instead;
+// see GROUP_STEP_PULSES in config-common.h.
+#ifdef FIXED_STEP_PINS
+#undef GROUP_STEP_PULSES
+#endif
+
 class Motion
 {
   // Singleton
@@ -17,7 +25,7 @@ class Motion
 public:
   static Motion& Instance() { static Motion instance; return instance; };
 private:
-  explicit Motion() :AXES((Axis[NUM_AXES])
+  explicit Motion() :blocks(MOVE_BUFSIZE, blocks_buf), AXES((Axis[NUM_AXES])
   {
     Axis(X_STEP_PIN,X_DIR_PIN,X_ENABLE_PIN,X_MIN_PIN,X_MAX_PIN,X_STEPS_PER_UNIT,X_INVERT_DIR,X_MAX_FEED,X_AVG_FEED,X_START_FEED,X_ACCEL_RATE,X_DISABLE),
     Axis(Y_STEP_PIN,Y_DIR_PIN,Y_ENABLE_PIN,Y_MIN_PIN,Y_MAX_PIN,Y_STEPS_PER_UNIT,Y_INVERT_DIR,Y_MAX_FEED,Y_AVG_FEED,Y_START_FEED,Y_ACCEL_RATE,Y_DISABLE),
@@ -27,19 +35,94 @@ private:
   {
     setupInterrupt();
     interruptOverflow=0;
+    stepsPerInterrupt=1;
     feed_modifier = 1.0f;
+    feed_scale = 256;
+    junction_deviation = JUNCTION_DEVIATION;
+#ifdef SCURVE_ACCEL
+    scurve = true;
+#else
+    scurve = false;
+#endif
+    arc_tolerance = ARC_TOLERANCE;
+    arc_plane = 0;
+    arc_active = false;
+#ifdef STEP_TRACE
+    trace_dirs = 0;
+    trace_steps = 0;
+    trace_period = 0;
+#endif
+#ifdef LINEAR_ADVANCE_K
+    advance_k = LINEAR_ADVANCE_K;
+    advance_steps = 0;
+    advance_target = 0;
+#endif
     busy = false;
+    underruns = 0;
+    replan = false;
+    invalidate_moves = false;
+    current_block = NULL;
+    for(int x=0;x<MOVE_BUFSIZE;x++)
+      blocks_buf[x].state = MoveBlock::DONE;
+    syncPlanpos();
+#if !defined(GROUP_STEP_PULSES) && !defined(FIXED_STEP_PINS)
+    steps_raised = 0;
+#endif
+    groupStepPins();
   };
   Motion(Motion&);
   Motion& operator=(Motion&);
 
+  MoveBlock blocks_buf[MOVE_BUFSIZE];
+  RingBufferT<MoveBlock> blocks;
+  int32_t planpos[NUM_AXES]; // where the last queued move ends, in steps
+  bool replan;
+  volatile bool invalidate_moves;
+  volatile uint16_t underruns;
+
   Axis AXES[NUM_AXES];
-  volatile GCode* volatile current_gcode;
+  volatile MoveBlock* volatile current_block;
   volatile unsigned long deltas[NUM_AXES];
   volatile long errors[NUM_AXES];
   volatile int interruptOverflow;
+  volatile uint8_t stepsPerInterrupt;
+#ifdef GROUP_STEP_PULSES
+  // Step pins by port: axis ax is bit step_mask[ax] of step_ports[step_group[ax]].
+  port_base_t step_ports[NUM_AXES];
+  uint8_t step_group[NUM_AXES];
+  uint8_t step_mask[NUM_AXES];
+  uint8_t step_groups;
+  uint8_t step_pulse[NUM_AXES];
+#elif !defined(FIXED_STEP_PINS)
+  uint8_t steps_raised; // axes stepAxis() has raised, by bit
+#endif
   bool busy;
   volatile float feed_modifier;
+  volatile uint16_t feed_scale; // feed_modifier as 8.8 fixed point, for the interrupt
+  float junction_deviation; // mm; 0 to corner by axis start feeds instead
+  bool scurve; // plan new moves with S-curve instead of trapezoid ramps
+
+  // The arc gcode_arc is cutting into chords.  Positions are in mm; the arc is
+  // around arc_center on axes arc_axes[0] and [1], and the other axes move
+  // in a straight line from arc_start to arc_end.
+  float arc_tolerance;
+  uint8_t arc_plane; // 0 XY, 1 ZX, 2 YZ
+  bool arc_active;
+  uint8_t arc_axes[2];
+  float arc_center[2];
+  float arc_radius;
+  float arc_angle; // of arc_start, radians
+  float arc_sweep; // signed; negative is clockwise
+  float arc_start[NUM_AXES];
+  float arc_end[NUM_AXES];
+  uint16_t arc_segments;
+  uint16_t arc_next; // next chord to queue, from 1
+
+#ifdef LINEAR_ADVANCE_K
+  float advance_k; // seconds
+  int32_t advance_steps;  // how far the extruder is ahead of the plan
+  int32_t advance_target; // and how far it should be, for the speed we're at
+#endif
 
 public:
   // Return request Axis
@@ -51,6 +134,20 @@ public:
   void setCurrentPosition(GCode &gcode);
   // Returns true if machine is in motion
   bool axesAreMoving(); 
+  // Should be called often from mainloop; starts and plans queued moves
+  void handlenext();
+  // Replan moves queued since the last time; see GcodeQueue::handlenext
+  bool needsPlan();
+  void planQueued() { if(needsPlan()) plan(1); }
+  // Roughly how long (us) before the steppers run out of planned moves, up to 'enough'
+  uint32_t queuedTime(uint32_t enough);
+  // Times the interrupt finished a move while the next was being replanned
+  uint16_t getUnderruns() { return underruns; }
+  void clearUnderruns() { underruns = 0; }
+  // Tells us whether all queued moves have finished.
+  bool isBufferEmpty() { return blocks.isEmpty(); }
+  // Tells us whether any queued move uses this axis.
+  bool isAxisQueued(int ax);
   // Change stored feedrates/axis data
   // WARNING: if you change steps per unit without then changing/resetting all feedrates
   // after things will not go well for you!
@@ -61,6 +158,13 @@ public:
   void setAccel(GCode& gcode);
   void setFeedModifier(float mod);
   float getFeedModifier();
+  void setJunctionDeviation(float mm);
+  void setSCurve(bool on) { scurve = on; }
+  void setArcTolerance(float mm) { if(mm > 0) arc_tolerance = mm; }
+  void setArcPlane(uint8_t plane) { arc_plane = plane; }
+#ifdef LINEAR_ADVANCE_K
+  void setLinearAdvance(float k) { if(k >= 0 && k < 1) advance_k = k; }
+#endif
 
   void setStepPins(GCode& gcode);
   void setDirPins(GCode& gcode);
@@ -76,35 +180,42 @@ public:
   // Motors automatically enabled when used
   void disableAllMotors();
   void disableAxis(int axis);
+  // M112: stop where we are and drop every queued move
+  void emergencyStop();
   void wrapup(GCode& gcode) { checkdisable(gcode); }
   void checkdisable(GCode& gcode);
 
-  // Uses step data to determine the actual ending position of a move
-  // (seldom /precisely/ the requested position)
-  void getActualEndpos(GCode& gcode);
-
 
-  // Run all the math on a G0/G1 movement Gcode to deal with movement later
-  void gcode_precalc(GCode& gcode, float& feedin, Point* lastend);
-  // Run extra math to do G1 even better
-  void gcode_optimize(GCode& gcode, GCode& nextg);
+  // Turn a G0/G1 movement Gcode into a queued move; false if the move queue is full
+  bool gcode_precalc(GCode& gcode, float& feedin);
+  // Queue a G2/G3 as chords, as many as fit; true once the whole arc is queued
+  bool gcode_arc(GCode& gcode, float& feedin);
+  // Lookahead: plan speeds across a run of consecutive queued moves
+  void gcode_plan(MoveBlock** moves, uint8_t count);
   // (re)compute acceleration curve after optimization
-  void computeAccel(GCode& gcode, GCode* nextg=NULL);
-  // Actually execute a (precalculated) movement gcode.
-  void gcode_execute(GCode& gcode);
+  void computeAccel(MoveBlock& block);
+  // Actually start a (precalculated) move.
+  void startMove(MoveBlock& block);
+  // Integer step rates for the interrupt, from a move's planned feeds
+  void setRates(MoveBlock& block);
 
   // Debugging and output to host...
   void writePositionToHost(GCode& gcode);
 
 private:
   // Calculate the number of steps for each axis in a move.
-  void getMovesteps(GCode& gcode);
-  float getSmallestStartFeed(GCode& gcode);
-  float getSmallestEndFeed(GCode& gcode);
+  void getMovesteps(MoveBlock& block, int32_t* target);
+  // Queue a move from planpos to target (in steps); there must be room
+  void queueMove(int32_t* target, int32_t linenum, float feed);
+  // Run all the math on a move from planpos to target (in steps)
+  void precalc(MoveBlock& block, int32_t* target);
+  // Plan from where the axes are now
+  void syncPlanpos();
+  void plan(uint8_t from);
+  void rebaseHead();
 
   // opt support
-  void fix_diverge(int32_t *ends, int32_t* starts);
-  bool join_moves(int32_t *ends, int32_t* starts);
+  float junction_feed(MoveBlock& a, MoveBlock& b);
 
 
 
@@ -118,8 +229,25 @@ private:
   void disableInterrupt(); 
   void resetTimer();
   void setInterruptCycles(unsigned long cycles); 
+  uint32_t interval_from_rate(uint32_t rate);
+  uint16_t ramp_ticks_step(uint32_t from, uint32_t to, uint32_t inc);
+  uint32_t scurve_rate(uint32_t from, uint32_t to, uint32_t u);
+  bool loadMove(MoveBlock& block);
+  bool chainMove();
+  void stepAxis(uint8_t axis);
+  bool takeStep(uint8_t axis);
+  void pulseSteps();
+  void advanceTarget();
+  void advanceExtruder();
+  void groupStepPins();
+#ifdef STEP_TRACE
+  uint8_t  trace_dirs;   // of the move running
+  uint16_t trace_steps;  // this pass, 4 bits per axis
+  uint32_t trace_period; // cycles between interrupts, as last set
+#endif
   int ax; // used to avoid allocing loop counter in interrupt.
   int accelsteps; 
+  uint8_t stepsdone;
 
 };
 
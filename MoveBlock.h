@@ -0,0 +1,104 @@
+#ifndef _MOVEBLOCK_H_
+#define _MOVEBLOCK_H_
+/* One planned movement, as handed from the planner to the step interrupt.
+ *
+ * G1 codes are turned into these by Motion::gcode_precalc as they reach the
+ * front of the GcodeQueue, and the GCode itself is done with.  Only what the
+ * planner and the interrupt need is kept, so the move queue can be a good deal
+ * deeper than the gcode queue.
+ */
+
+#include "config.h"
+#include "Point.h"
+#include "FixedPoint.h"
+#include "Host.h"
+
+class MoveBlock
+{
+public:
+  // The interrupt moves straight on from an ACTIVE block to the next one if it's
+  // PLANNED; the planner marks blocks REPLANNING while it changes them so it
+  // won't.  Free slots are DONE.
+  enum mb_states_t { PLANNED, ACTIVE, DONE, REPLANNING };
+  volatile uint8_t state;
+  int32_t  linenum;
+
+  // Stepping; movesteps counts down in the interrupt.
+  volatile uint32_t movesteps;
+  uint32_t axismovesteps[NUM_AXES];
+  uint8_t  axisdirs; // bit set for each axis going forward; see isForward()
+  uint8_t  leading_axis;
+
+  uint32_t accel_until;
+  uint32_t decel_from;
+  uint32_t accel_timer;
+  uint32_t currentinterval;
+
+  // Leading axis step rates in steps/sec << 8, for the interrupt; set by Motion::setRates
+  uint32_t currentrate;
+  uint32_t maxrate;
+  uint32_t endrate;
+  uint32_t rate_inc;
+
+  // S-curve mode: speed follows a smoothstep from startrate to peakrate, and
+  // from wherever decel starts (decel_base) down to endrate.  The ramps take
+  // as long and go as far as the trapezoid's, so the planner needn't know.
+  bool     scurve;
+  uint32_t startrate;
+  uint32_t peakrate;
+  uint32_t decel_base;   // 0 until decel starts
+  uint32_t ramp_u;       // progress through the current ramp, Q16
+  uint16_t accel_u_step; // ramp_u per accel tick
+  uint16_t decel_u_step; // set when decel starts
+
+  // Linear advance: extruder steps to run ahead per leading axis step/sec, Q16
+  uint32_t advance_scale;
+
+  // Planning.  Feeds are the leading axis' feed in mm/min, which precalc
+  // keeps under 0xFFFF.
+  uint16_t feed;      // requested path feed
+  float    leadratio; // leading axis feed / path feed
+  float    max_entry; // fastest path feed we can corner into this move at; 0 until planned
+  float    accel;
+  uint32_t accel_dist_scale; // leading axis steps per (mm/min)^2 of speed change, Q0.32
+  uint16_t startfeed;
+  uint16_t maxfeed;
+  uint16_t endfeed;
+  uint16_t minfeed;
+
+  int32_t  startpos[NUM_AXES]; // in steps
+
+  bool isForward(uint8_t ax) { return axisdirs & _BV(ax); }
+  int32_t getEndpos(uint8_t ax)
+  {
+    return isForward(ax) ? startpos[ax] + (int32_t)axismovesteps[ax] : startpos[ax] - (int32_t)axismovesteps[ax];
+  }
+
+  // Leading axis steps it takes to get from start to end feed (mm/min).
+  uint32_t getAccelDist(uint32_t start, uint32_t end)
+  {
+    if(end > 0xFFFF)
+      end = 0xFFFF;
+    if(end <= start)
+      return 0;
+    return mul_q32((end - start) * (end + start), accel_dist_scale);
+  }
+
+  void dump_movedata()
+  {
+#ifdef DEBUG_MOVE
+    HOST.labelnum("L:",linenum,false);
+    HOST.labelnum(" F:",feed,false);
+    HOST.labelnum(" Steps:",axismovesteps[leading_axis],false);
+    HOST.labelnum(" Lead:",leading_axis,false);
+    HOST.labelnum(" CurI:",currentinterval,false);
+    HOST.labelnum(" StartF:",startfeed,false);
+    HOST.labelnum(" MaxF:",maxfeed,false);
+    HOST.labelnum(" EndF:",endfeed,false);
+    HOST.labelnum(" AUnt:",accel_until,false);
+    HOST.labelnum(" DFrom:",decel_from,true);
+#endif
+  }
+};
+
+#endif // _MOVEBLOCK_H_
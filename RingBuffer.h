@@ -101,6 +101,15 @@ template<typename T> class RingBufferT
 
     }
 
+    // The element after p, for walking forward from &peek(index) without
+    // starting over from head each step.
+    inline DTYPE* next(DTYPE* p)
+    {
+      if(++p == end)
+        p = start;
+      return p;
+    }
+
     inline void remove(RB_SIZE_TYPE count_in)
     {
       for(RB_SIZE_TYPE c = count_in;c > 0;c--)
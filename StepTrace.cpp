@@ -0,0 +1,38 @@
+#include "StepTrace.h"
+
+#ifdef STEP_TRACE
+#include <avr/pgmspace.h>
+#include <util/atomic.h>
+
+namespace steptrace
+{
+  entry_t buf[STEP_TRACE];
+  uint16_t head = 0;
+  uint16_t count = 0;
+
+  // "trace <entries>", a newline, then the raw entries.  Only called once the
+  // move queue has run dry, so the interrupt isn't adding to it underneath us.
+  void dump(Host& h)
+  {
+    uint16_t n, i;
+    ATOMIC_BLOCK(ATOMIC_RESTORESTATE)
+    {
+      n = count;
+      i = head + STEP_TRACE - count;
+      count = 0;
+    }
+
+    h.labelnum("trace ", n);
+    for(;n;n--,i++)
+    {
+      entry_t& e = buf[i % STEP_TRACE];
+      h.write(e.kind);
+      h.write((uint8_t)(e.steps & 0xFF));
+      h.write((uint8_t)(e.steps >> 8));
+      h.write((uint8_t)(e.value & 0xFF));
+      h.write((uint8_t)(e.value >> 8));
+    }
+    h.endl();
+  }
+};
+#endif
@@ -0,0 +1,57 @@
+#ifndef _STEPTRACE_H_
+#define _STEPTRACE_H_
+/* Step event recorder, to check the speeds the steppers really ran at against
+ * what the planner laid out, without a scope.
+ *
+ * With STEP_TRACE defined, the step interrupt adds an entry for every pass:
+ * how many steps each axis took, which way, and how long since the last pass.
+ * Starting a move adds header entries with its line number and planned accel
+ * and decel steps.  The last STEP_TRACE entries are kept; M312 dumps them to
+ * the host in binary and util/steptrace.pl decodes them.
+ *
+ * Entries are 5 bytes:
+ *   kind    low nibble: axis directions, 1 is positive; or MOVE_* for a header
+ *   steps   little endian, 4 bits per axis, X lowest; the leading axis in a header
+ *   value   little endian: microseconds since the last pass, or the header value
+ */
+
+#include "config.h"
+
+#ifdef STEP_TRACE
+#include <stdint.h>
+#include "Host.h"
+
+namespace steptrace
+{
+  enum { MOVE_LINE = 0x80, MOVE_ACCEL, MOVE_DECEL };
+
+  struct entry_t
+  {
+    uint8_t kind;
+    uint16_t steps;
+    uint16_t value;
+  };
+
+  extern entry_t buf[STEP_TRACE];
+  extern uint16_t head;
+  extern uint16_t count;
+
+  // Called from the step interrupt.
+  inline void add(uint8_t kind, uint16_t steps, uint16_t value)
+  {
+    entry_t& e = buf[head];
+    e.kind = kind;
+    e.steps = steps;
+    e.value = value;
+    if(++head == STEP_TRACE)
+      head = 0;
+    if(count < STEP_TRACE)
+      count++;
+  }
+
+  // Write out everything recorded, oldest first, and start again.
+  void dump(Host& h);
+};
+#endif
+
+#endif // _STEPTRACE_H_
@@ -19,6 +19,7 @@
 #include <avr/io.h>
 #include <avr/interrupt.h>
 #include <util/atomic.h>
+#include "IsrProfile.h"
 
 #if ((defined __AVR_ATmega2560__) || (defined __AVR_ATmega1280__))
 #define USE_MOAR_ANALOG
@@ -86,6 +87,7 @@ bool startAnalogRead(uint8_t pin, volatile int16_t* destination, volatile bool*
 
 ISR(ADC_vect)
 {
+	PROFILE_ISR(ADC_DONE);
 	uint8_t low_byte, high_byte;
 	// we have to read ADCL first; doing so locks both ADCL
 	// and ADCH until ADCH is read.  reading ADCL second would
@@ -18,17 +18,17 @@
 
 #include "AvrPort.h"
 
-Port PortA(0x20);
-Port PortB(0x23);
-Port PortC(0x26);
-Port PortD(0x29);
-Port PortE(0x2C);
-Port PortF(0x2F);
-Port PortG(0x32);
-Port PortH(0x100);
-Port PortJ(0x103);
-Port PortK(0x106);
-Port PortL(0x109);
+Port PortA(PORTBASE_A);
+Port PortB(PORTBASE_B);
+Port PortC(PORTBASE_C);
+Port PortD(PORTBASE_D);
+Port PortE(PORTBASE_E);
+Port PortF(PORTBASE_F);
+Port PortG(PORTBASE_G);
+Port PortH(PORTBASE_H);
+Port PortJ(PORTBASE_J);
+Port PortK(PORTBASE_K);
+Port PortL(PORTBASE_L);
 Port PortNull(0xFFFF);
 
 Port PORTMAP[] =
@@ -35,6 +35,19 @@
 typedef uint16_t port_base_t;
 #define NULL_PORT 0xffff
 
+// port_base of each port, for FixedPin below.
+#define PORTBASE_A 0x20
+#define PORTBASE_B 0x23
+#define PORTBASE_C 0x26
+#define PORTBASE_D 0x29
+#define PORTBASE_E 0x2C
+#define PORTBASE_F 0x2F
+#define PORTBASE_G 0x32
+#define PORTBASE_H 0x100
+#define PORTBASE_J 0x103
+#define PORTBASE_K 0x106
+#define PORTBASE_L 0x109
+
 class Port;
 extern Port PORTMAP[];
 
@@ -85,5 +98,21 @@ public:
   uint16_t getPortIndex() const { return port.getpb(); }
 };
 
+// A pin fixed at compile time, for boards whose config names it.  With the
+// register address a constant, setValue is a single sbi/cbi on ports A-G
+// (and a plain lds/sts on the rest) instead of going through port_base.
+// Same interface as Pin, so code templated on the pin type takes either.
+template <port_base_t PB, uint8_t BIT>
+class FixedPin {
+public:
+	bool isNull() { return PB == NULL_PORT; }
+	bool getValue() { return (_SFR_MEM8(PB+0) & _BV(BIT)) != 0; }
+	void setValue(bool on) {
+		if(on) _SFR_MEM8(PB+2) |= _BV(BIT);
+		else   _SFR_MEM8(PB+2) &= ~_BV(BIT);
+	}
+};
+typedef FixedPin<NULL_PORT,0> NoFixedPin;
+
 #endif // SHARED_AVR_PORT_HH_
 
@@ -9,17 +9,23 @@
 #define REPG_COMPAT
 // Maximum length of a single 'fragment' of Gcode; characters in-between spaces.
 #define MAX_GCODE_FRAG_SIZE 32
-// Gcode is a big structure here, 10 is a lot of ram.
+// Gcode is a big structure here, 10 is a lot of ram.  G1s only wait in it until
+// there's room on the (much smaller per entry) move queue, so it can be short.
 #ifdef __AVR_ATmega644P__
-#define GCODE_BUFSIZE 5
+#define GCODE_BUFSIZE 3
+#define MOVE_BUFSIZE 8
 #define HOST_RECV_BUFSIZE 100
 #define HOST_SEND_BUFSIZE 100
 #else
-#define GCODE_BUFSIZE 10
+#define GCODE_BUFSIZE 4
+#define MOVE_BUFSIZE 24
 #define HOST_RECV_BUFSIZE 200
 #define HOST_SEND_BUFSIZE 200
 #endif
 
+// Most parameters (letters) one gcode line can carry; any more are dropped.
+#define GCODE_MAX_PARAMS 10
+
 // Each source eats anough ram for 1 addtl gcode
 #if (defined HAS_BT) || defined(HAS_KEYPAD)
 #define GCODE_SOURCES 5
@@ -45,9 +51,69 @@
 #define HOST_BAUD 57600
 // if defined, INTERRUPT_STEPS allows the comm ISRs to interrupt the movement ISR.
 #define INTERRUPT_STEPS
+// When the step interval (in cycles) drops below this, take 2, 4 or 8 steps per
+// interrupt and stretch the interrupt interval to match, so fast moves don't
+// swamp the CPU with interrupts.  Comment out to always take a single step.
+#define MULTISTEP_INTERVAL 2000
+// Microseconds each step pulse is held high, and held low before the next one
+// when several steps go out in one interrupt (the drivers' minimum step high
+// and low times; interrupts themselves are further apart than this).  A4988s
+// want 1, DRV8825s 2.  Comment out to pulse as fast as the code runs.
+#define STEP_PULSE_US 2
+// Work out which axes step first, then raise and lower their step pins a port
+// at a time, so axes sharing a port pulse together with one write each way.
+// Comment out to pulse each axis' pin in turn.  Boards with FIXED_STEP_PINS
+// don't group: a single sbi/cbi per pin is quicker than a read-modify-write
+// through a port address, and M300/M304/M305 can't move their pins anyway.
+#define GROUP_STEP_PULSES
+// Microseconds DIR has to be steady before and after a step (the drivers' DIR
+// setup and hold times).  A move chained from the one before gets its DIR an
+// interrupt ahead of its first step; one started from idle waits this long for
+// it.  Linear advance steps may turn the extruder's DIR round between two of
+// the move's steps, so they wait this long either side of it.
+// A4988s want 1, DRV8825s 2.
+#define STEP_DIR_DELAY_US 2
+// Default cornering for the lookahead: how far (mm) the path may be thought of as
+// deviating from a corner when working out how fast to take it.  0 limits each
+// axis' change in speed at a corner to its start feed instead.  See M209.
+#define JUNCTION_DEVIATION 0.02f
+// Uncomment to ramp speeds along an S-curve by default instead of straight
+// lines, so acceleration eases in and out rather than switching on and off.
+// Moves are planned with 2/3 the accel so the curve's peak is the configured
+// rate.  See M210.
+//#define SCURVE_ACCEL
+// G2/G3 arcs are cut into straight chords that stray no further than this (mm)
+// from the true arc.  See M212.
+#define ARC_TOLERANCE 0.01f
+// Linear advance: run the extruder ahead of where the plan has it by this many
+// seconds' worth of its current speed, so nozzle pressure keeps up through accel
+// and decel and corners don't bulge.  0 to leave it off; see M900.  Comment out
+// to build without it.
+#define LINEAR_ADVANCE_K 0.0f
+// Uncomment to count the cycles each interrupt handler takes, for M311.  Uses
+// TIMER5, so 1280/2560 only.
+//#define ISR_PROFILE
+// Uncomment to keep a trace of the last this many step interrupts, 5 bytes
+// each, for M312 and util/steptrace.pl.
+//#define STEP_TRACE 512
+// Fold a G1 into the one queued before it when it carries straight on at the
+// same feed and extrusion rate, so long runs of tiny segments take one gcode
+// slot and one move.  Nothing merged away may stray further than this (mm, and
+// mm of filament for E) from the merged line.  See M213; comment out to queue
+// every move as sent.
+#define MERGE_TOLERANCE 0.005f
+// GcodeQueue::handlenext turns queued gcodes into moves and replans them for as
+// long as the steppers have planned moves to get on with, less PLAN_MARGIN
+// (us), but no longer than PLAN_BUDGET (us) at a time, so serial and the
+// heaters still get a look in.  See M313 for how often the steppers ran dry.
+#define PLAN_MARGIN 2000
+#define PLAN_BUDGET 20000
+// With less than PLAN_MARGIN queued, the replan is put off, but for no more
+// than this many handlenext passes in a row; M313 counts the times.
+#define PLAN_DEFERRALS 8
 // How often to recompute speed for acceleration in sjfw
 #define ACCELS_PER_SECOND 1000.0f
-#define ACCEL_INC_TIME F_CPU/ACCELS_PER_SECOND
+#define ACCEL_INC_TIME ((uint32_t)(F_CPU/ACCELS_PER_SECOND))
 
 //#define COMMS_ERR2
 //#define DEBUG_OPT
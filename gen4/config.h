@@ -69,4 +69,21 @@
 #define A_ACCEL_RATE    1000
 #define A_DISABLE       false
 
+// The step and endstop pins again, as compile-time types so the step interrupt
+// can set them with single instructions.  They must match the Pin()s above,
+// so M300, M304 and M305 are refused rather than moving only some of them.
+#define FIXED_STEP_PINS
+#define X_STEP_FIXED  FixedPin<PORTBASE_A,6>
+#define X_MIN_FIXED   FixedPin<PORTBASE_B,6>
+#define X_MAX_FIXED   FixedPin<PORTBASE_B,5>
+#define Y_STEP_FIXED  FixedPin<PORTBASE_A,3>
+#define Y_MIN_FIXED   FixedPin<PORTBASE_B,4>
+#define Y_MAX_FIXED   FixedPin<PORTBASE_H,6>
+#define Z_STEP_FIXED  FixedPin<PORTBASE_A,0>
+#define Z_MIN_FIXED   FixedPin<PORTBASE_H,5>
+#define Z_MAX_FIXED   FixedPin<PORTBASE_H,4>
+#define A_STEP_FIXED  FixedPin<PORTBASE_J,0>
+#define A_MIN_FIXED   NoFixedPin
+#define A_MAX_FIXED   NoFixedPin
+
 #endif // CONFIG_H
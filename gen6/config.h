@@ -82,6 +82,23 @@ THIS CONFIG FILE IS NOT READY FOR USE.
 #define A_LENGTH        110
 #define A_DISABLE       false
 
+// The step and endstop pins again, as compile-time types so the step interrupt
+// can set them with single instructions.  They must match the Pin()s above,
+// so M300, M304 and M305 are refused rather than moving only some of them.
+#define FIXED_STEP_PINS
+#define X_STEP_FIXED  FixedPin<PORTBASE_D,7>
+#define X_MIN_FIXED   FixedPin<PORTBASE_C,4>
+#define X_MAX_FIXED   NoFixedPin
+#define Y_STEP_FIXED  FixedPin<PORTBASE_C,7>
+#define Y_MIN_FIXED   FixedPin<PORTBASE_A,6>
+#define Y_MAX_FIXED   NoFixedPin
+#define Z_STEP_FIXED  FixedPin<PORTBASE_A,4>
+#define Z_MIN_FIXED   FixedPin<PORTBASE_A,1>
+#define Z_MAX_FIXED   NoFixedPin
+#define A_STEP_FIXED  FixedPin<PORTBASE_B,4>
+#define A_MIN_FIXED   NoFixedPin
+#define A_MAX_FIXED   NoFixedPin
+
 
 #define LCD_RS_PIN      Pin(PortC,5)
 #define LCD_RW_PIN      Pin(PortL,2)
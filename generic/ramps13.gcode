@@ -19,6 +19,10 @@ M200 X62.745 Y62.745 Z566.93 E729.99 ;set axis steps per mm
 M201 X2000 Y2000 Z75 E1500 ;set axis start speeds
 M202 X6000 Y6000 Z300 E2000 ;set axis max speeds
 M206 X1500 Y1500 Z100 E2000 ;set accel mm/s/s
+M209 P20     ;set cornering junction deviation in microns; P0 = limit by start speeds
+M210 P0      ;acceleration profile; P1 = S-curve, P0 = trapezoid
+M212 P10     ;how far (microns) G2/G3 arc chords may stray from the arc
+M900 K0      ;linear advance, seconds of extruder speed to run ahead; K0 = off
 
 ; LCD setup as per wiki.
 M250 P63     ;set LCD RS pin
@@ -8,6 +8,7 @@
 #include <avr/interrupt.h>
 #include "Globals.h"
 #include "Eeprom.h"
+#include "IsrProfile.h"
 #ifdef USE_MARLIN
 #include "Marlin.h"
 #endif
@@ -25,12 +26,9 @@ extern LCDKeypad LCDKEYPAD;
 
 void mainloop()
 {
-	// TODO: check to see whether interleaving calls to GCODES.handlenext really gains me anything.
 	for (;;) {
-		// Checks to see if gcodes are waiting to run and runs them if so.
-		GCODES.handlenext();
-		// Rather than interleaving, we'll just run it twice in succession, to catch instances where it
-		// wants an immediate rerun, otherwise assume it's good 'till we get back.
+		// Checks to see if gcodes are waiting to run and runs them if so; it takes
+		// as many as there's time for before the moves run out.
 		GCODES.handlenext();
 		GCODES.checkaxes();
 
@@ -73,6 +71,9 @@ int main(void)
 {
 	sei();
 	init_time();
+#ifdef ISR_PROFILE
+	isrprofile::init();
+#endif
 
 #ifdef HAS_SD
 	sdcard::reset();
@@ -70,6 +70,23 @@
 #define A_ACCEL_RATE    2000
 #define A_DISABLE       false
 
+// The step and endstop pins again, as compile-time types so the step interrupt
+// can set them with single instructions.  They must match the Pin()s above,
+// so M300, M304 and M305 are refused rather than moving only some of them.
+#define FIXED_STEP_PINS
+#define X_STEP_FIXED  FixedPin<PORTBASE_F,0>
+#define X_MIN_FIXED   FixedPin<PORTBASE_E,5>
+#define X_MAX_FIXED   FixedPin<PORTBASE_E,4>
+#define Y_STEP_FIXED  FixedPin<PORTBASE_F,6>
+#define Y_MIN_FIXED   FixedPin<PORTBASE_J,1>
+#define Y_MAX_FIXED   FixedPin<PORTBASE_J,0>
+#define Z_STEP_FIXED  FixedPin<PORTBASE_L,3>
+#define Z_MIN_FIXED   FixedPin<PORTBASE_D,3>
+#define Z_MAX_FIXED   FixedPin<PORTBASE_D,2>
+#define A_STEP_FIXED  FixedPin<PORTBASE_A,4>
+#define A_MIN_FIXED   NoFixedPin
+#define A_MAX_FIXED   NoFixedPin
+
 
 // The following config is for a parallel LCD connected to 
 // AUX-2 in 4-bit mode.
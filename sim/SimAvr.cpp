@@ -0,0 +1,225 @@
+/* Fake AVR register/timer layer for the host simulator.
+ *
+ * TIMER1 runs in fast PWM with TOP = OCR1A just like Motion::setupInterrupt
+ * configures it, clocked at F_CPU.  The compare flag is latched whether or not
+ * OCIE1A is set, so enabling the interrupt with a stale flag fires at once, the
+ * same as on the chip.
+ */
+
+#include "SimAvr.h"
+#include <avr/io.h>
+#include <avr/interrupt.h>
+#include <stdio.h>
+
+extern "C" void TIMER1_COMPA_vect(void);
+extern "C" void USART0_UDRE_vect(void);
+
+SimReg8 sim_io[SIM_IO_SIZE];
+
+SimReg8 PRR0, PRR1;
+SimReg8 TCCR0B, TIMSK0, TIFR0, TCNT0;
+SimReg8 TCCR1A, TCCR1B, TIFR1, TIMSK1;
+SimReg8 TCCR5A, TCCR5B;
+// Reset value would be 0, which with TOP=OCR1A means a compare every cycle;
+// start at the top of the range so an idle simulator isn't spinning on it.
+volatile uint16_t OCR1A = 0xFFFF, TCNT1;
+SimReg8 UCSR0A, UCSR0B, UCSR0C, UDR0;
+SimReg8 UCSR2A, UCSR2B, UCSR2C, UDR2;
+volatile uint16_t UBRR0, UBRR2;
+SimReg8 ADCSRA, ADCSRB, ADMUX, ADCL, ADCH;
+
+volatile uint64_t sim_cycles = 0;
+uint32_t sim_isr_cost = 0;
+uint64_t sim_isr_cycles = 0;
+uint64_t sim_isr_count = 0;
+uint64_t sim_t1_off_cycles = 0;
+
+static uint64_t t1_next = 0x10000;
+static bool     t1_flag = false;
+
+static void t1_service()
+{
+  // A busy wait in the vector runs the clock on; the compare being serviced
+  // mustn't look missed meanwhile.  One really missed is latched on return.
+  // The vector turns its own interrupt off while it runs, which isn't the
+  // steppers sitting idle.
+  uint64_t next = t1_next;
+  uint64_t off = sim_t1_off_cycles;
+  t1_next = ~(uint64_t)0;
+  t1_flag = false;
+  TIMER1_COMPA_vect();
+  t1_next = next;
+  sim_t1_off_cycles = off;
+  sim_cycles += sim_isr_cost;
+  sim_isr_cycles += sim_isr_cost;
+  sim_isr_count++;
+}
+
+void sim_run_cpu(uint32_t cycles)
+{
+  uint64_t left = cycles;
+  for(;;)
+  {
+    if(t1_flag && (TIMSK1 & _BV(OCIE1A)))
+    {
+      t1_service();
+      continue;
+    }
+
+    // We were held up (inside an interrupt) past a compare; latch it.
+    if(t1_next < sim_cycles)
+    {
+      t1_flag = true;
+      t1_next = sim_cycles + OCR1A + 1;
+      continue;
+    }
+
+    uint64_t wait = t1_next - sim_cycles;
+    if(wait > left)
+      wait = left;
+    if(!(TIMSK1 & _BV(OCIE1A)))
+      sim_t1_off_cycles += wait;
+    sim_cycles += wait;
+    left -= wait;
+    if(sim_cycles < t1_next)
+      return;
+
+    // The timer runs on while the vector does, so the next compare is timed
+    // from this one, not from when the vector is done.
+    uint64_t match = t1_next;
+    t1_flag = true;
+    if(TIMSK1 & _BV(OCIE1A))
+      t1_service();
+    t1_next = match + OCR1A + 1;
+  }
+}
+
+
+/*** UART ***/
+static void (*uart_out)(uint8_t c) = 0;
+
+static void udr0_hook(SimReg8& r, uint8_t)
+{
+  uart_out(r.v);
+}
+
+// Transmit is instantaneous: as soon as Host enables UDRIE we run the UDRE
+// vector until the tx ring is empty.
+static void ucsr0b_hook(SimReg8& r, uint8_t)
+{
+  static bool draining = false;
+  if(draining)
+    return;
+  draining = true;
+  while(r.v & _BV(UDRIE0))
+    USART0_UDRE_vect();
+  draining = false;
+}
+
+
+/*** Port pins ***/
+static void (*pin_edge[SIM_IO_SIZE])(uint16_t addr, uint8_t bit, bool high);
+static uint8_t driven[SIM_IO_SIZE], drive_level[SIM_IO_SIZE];
+
+// PINx reads back PORTx: outputs read their level, inputs read high exactly
+// when their pullup is on.  The exception is a pin sim_drive_pin holds.
+static void port_hook(SimReg8& r, uint8_t was)
+{
+  uint16_t addr = &r - sim_io;
+  sim_io[addr-2].v = (r.v & ~driven[addr]) | (drive_level[addr] & driven[addr]);
+
+  uint8_t changed = (r.v ^ was) & r.watch;
+  if(!changed)
+    return;
+  for(uint8_t b=0;b<8;b++)
+  {
+    if(changed & _BV(b))
+      pin_edge[addr](addr, b, r.v & _BV(b));
+  }
+}
+
+void sim_watch_pin(uint16_t addr, uint8_t bit, void (*edge)(uint16_t addr, uint8_t bit, bool high))
+{
+  if(addr >= SIM_IO_SIZE || sim_io[addr].hook != port_hook)
+    return;
+  pin_edge[addr] = edge;
+  sim_io[addr].watch |= _BV(bit);
+}
+
+void sim_drive_pin(uint16_t addr, uint8_t bit, bool level)
+{
+  if(addr >= SIM_IO_SIZE || sim_io[addr].hook != port_hook)
+    return;
+  driven[addr] |= _BV(bit);
+  if(level)
+    drive_level[addr] |= _BV(bit);
+  else
+    drive_level[addr] &= ~_BV(bit);
+  sim_io[addr-2].v = (sim_io[addr].v & ~driven[addr]) | (drive_level[addr] & driven[addr]);
+}
+
+void sim_release_pin(uint16_t addr, uint8_t bit)
+{
+  if(addr >= SIM_IO_SIZE || sim_io[addr].hook != port_hook)
+    return;
+  driven[addr] &= ~_BV(bit);
+  sim_io[addr-2].v = (sim_io[addr].v & ~driven[addr]) | (drive_level[addr] & driven[addr]);
+}
+
+void sim_init(void (*out)(uint8_t c))
+{
+  // PORTA-PORTG and PORTH-PORTL; see AvrPort.cpp for the port bases.
+  for(uint16_t pb=0x20;pb<=0x32;pb+=3)
+  {
+    sim_io[pb+2].hook = port_hook;
+    sim_io[pb].v = sim_io[pb+2].v;
+  }
+  for(uint16_t pb=0x100;pb<=0x109;pb+=3)
+  {
+    sim_io[pb+2].hook = port_hook;
+    sim_io[pb].v = sim_io[pb+2].v;
+  }
+
+  uart_out = out;
+  UDR0.hook = udr0_hook;
+  UCSR0B.hook = ucsr0b_hook;
+  // Flush anything written while the singletons were being built.
+  UCSR0B |= _BV(UDRIE0);
+}
+
+
+/*** avr-libc extras ***/
+char* ultoa(unsigned long val, char* s, int radix)
+{
+  char tmp[33];
+  int i = 0;
+  do
+  {
+    int d = val % radix;
+    tmp[i++] = d < 10 ? '0' + d : 'a' + d - 10;
+    val /= radix;
+  } while(val);
+  int o = 0;
+  while(i)
+    s[o++] = tmp[--i];
+  s[o] = 0;
+  return s;
+}
+
+char* ltoa(long val, char* s, int radix)
+{
+  if(val < 0 && radix == 10)
+  {
+    s[0] = '-';
+    ultoa(-(unsigned long)val, s + 1, radix);
+    return s;
+  }
+  return ultoa((unsigned long)val, s, radix);
+}
+
+char* dtostrf(double val, signed char width, unsigned char prec, char* s)
+{
+  // Host only ever hands us its 32 byte convbuf.
+  snprintf(s, 32, "%*.*f", width, prec, val);
+  return s;
+}
@@ -0,0 +1,79 @@
+#ifndef _SIMAVR_H_
+#define _SIMAVR_H_
+/* Fake AVR register/timer layer for the host simulator.
+ *
+ * Everything the motion pipeline touches on the real chip (TIMER1, the PORTx
+ * block behind AvrPort's _SFR_MEM8, the USARTs) is backed by plain memory here.
+ * A few registers have write hooks so the simulator can see step pulses and
+ * drain the serial transmitter.  Simulated time only advances when the
+ * simulator says so (see sim_run_cpu below).
+ */
+
+#include <stdint.h>
+#include <stdlib.h>
+
+#define _BV(bit) (1 << (bit))
+
+// 8-bit register with an optional write hook.
+class SimReg8
+{
+public:
+  typedef void (*hook_t)(SimReg8& r, uint8_t was);
+
+  // constexpr so the register file is constant-initialized, before any of the
+  // firmware singletons' constructors get to write to it.
+  constexpr SimReg8() : v(0), watch(0), hook(0) {}
+
+  operator uint8_t() const { return v; }
+  SimReg8& operator=(uint8_t n)
+  {
+    uint8_t was = v;
+    v = n;
+    if(hook) hook(*this, was);
+    return *this;
+  }
+  SimReg8& operator=(const SimReg8& r) { return *this = (uint8_t)r.v; }
+  SimReg8& operator|=(uint8_t n) { return *this = (uint8_t)(v | n); }
+  SimReg8& operator&=(uint8_t n) { return *this = (uint8_t)(v & n); }
+  SimReg8& operator^=(uint8_t n) { return *this = (uint8_t)(v ^ n); }
+
+  uint8_t v;
+  uint8_t watch;   // bits the hook cares about
+  hook_t  hook;
+};
+
+// I/O memory as seen by _SFR_MEM8; big enough for PORTL on the 2560.
+#define SIM_IO_SIZE 0x140
+extern SimReg8 sim_io[SIM_IO_SIZE];
+
+// Simulated CPU clock, in F_CPU cycles since reset.
+extern volatile uint64_t sim_cycles;
+// Cycles charged per TIMER1 compare interrupt (rough AVR cost of handleInterrupt).
+extern uint32_t sim_isr_cost;
+// Cycles spent inside TIMER1 interrupts so far.
+extern uint64_t sim_isr_cycles;
+// Number of TIMER1 interrupts serviced so far.
+extern uint64_t sim_isr_count;
+// Cycles spent with the TIMER1 compare interrupt disabled (stepper idle).
+extern uint64_t sim_t1_off_cycles;
+
+// Hook up the simulated pins and UART; call once the firmware singletons exist.
+// Firmware output is handed to 'out' a byte at a time.
+void sim_init(void (*out)(uint8_t c));
+// Run 'cycles' worth of mainloop CPU time, servicing the TIMER1 compare
+// interrupt whenever it comes due (interrupt time is added on top).
+void sim_run_cpu(uint32_t cycles);
+// Call 'edge' whenever bit 'bit' of I/O address 'addr' changes; 'high' is its
+// new level.
+void sim_watch_pin(uint16_t addr, uint8_t bit, void (*edge)(uint16_t addr, uint8_t bit, bool high));
+// Make bit 'bit' of the port whose PORTx is at 'addr' read 'level' in PINx,
+// as if something outside drove it, until sim_release_pin.
+void sim_drive_pin(uint16_t addr, uint8_t bit, bool level);
+void sim_release_pin(uint16_t addr, uint8_t bit);
+
+// avr-libc stdlib extensions used by Host.
+char* ultoa(unsigned long val, char* s, int radix);
+char* ltoa(long val, char* s, int radix);
+char* dtostrf(double val, signed char width, unsigned char prec, char* s);
+
+#endif // _SIMAVR_H_
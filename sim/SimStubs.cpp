@@ -0,0 +1,73 @@
+/* Host simulator replacements for the parts of the firmware that talk to
+ * hardware we don't model: timer0 timekeeping, heaters, eeprom, SD card.
+ *
+ * Time comes from the simulated clock.  Heaters reach their setpoint the
+ * instant it is set, so M109/M116 never hold the queue.
+ */
+
+#include "Time.h"
+#include "Temperature.h"
+#include "Eeprom.h"
+#include "SDCard.h"
+#include "SimAvr.h"
+
+
+/*** Time ***/
+void init_time() { }
+
+unsigned long millis() { return sim_cycles / (F_CPU / 1000UL); }
+unsigned long micros() { return sim_cycles / (F_CPU / 1000000UL); }
+
+void wait(unsigned long t) { sim_run_cpu(t * (F_CPU / 1000UL)); }
+
+
+/*** Temperature ***/
+Thermistor::Thermistor(int8_t analog_pin_in, uint8_t table_index_in) :
+  analog_pin(analog_pin_in), raw_valid(false), next_sample(0), table_index(table_index_in)
+{
+  current_temp = 0;
+}
+void Thermistor::init() { }
+void Thermistor::changeTable(int16_t, int16_t, int8_t) { }
+
+Temperature::Temperature()
+  : hotend_therm(HOTEND_TEMP_PIN, 0),
+    platform_therm(PLATFORM_TEMP_PIN, 1),
+    hotend_heat(HOTEND_HEAT_PIN),
+    platform_heat(PLATFORM_HEAT_PIN)
+{
+  report_m = 0;
+  report_l = 0;
+  report_h = 0;
+  hotend_setpoint = 0;
+  platform_setpoint = 0;
+}
+
+void Temperature::update() { doreport(); }
+void Temperature::doreport() { }
+bool Temperature::setHotend(uint16_t temp) { hotend_setpoint = temp; return true; }
+bool Temperature::setPlatform(uint16_t temp) { platform_setpoint = temp; return true; }
+uint16_t Temperature::getHotend() { return hotend_setpoint; }
+uint16_t Temperature::getPlatform() { return platform_setpoint; }
+uint16_t Temperature::getHotendST() { return hotend_setpoint; }
+uint16_t Temperature::getPlatformST() { return platform_setpoint; }
+
+
+/*** Eeprom ***/
+namespace eeprom
+{
+  void Stop() { }
+  bool beginRead() { return false; }
+  bool beginWrite() { return false; }
+  bool writebytes(char const*, int) { return false; }
+  void update() { }
+};
+
+
+/*** SD card ***/
+namespace sdcard
+{
+  struct fat_file_struct* file = 0;
+  bool openFile(const char*, struct fat_file_struct**) { return false; }
+  void finishRead() { }
+};
@@ -0,0 +1,23 @@
+#ifndef _SIM_AVR_INTERRUPT_H_
+#define _SIM_AVR_INTERRUPT_H_
+/* Host simulator stand-in for <avr/interrupt.h>.
+ * Vectors become ordinary functions the simulator calls when an interrupt is due.
+ */
+
+#include <avr/io.h>
+
+#define ISR(vector, ...) extern "C" void vector(void); extern "C" void vector(void)
+
+#define TIMER0_OVF_vect   sim_vect_timer0_ovf
+#define TIMER1_COMPA_vect sim_vect_timer1_compa
+#define USART0_RX_vect    sim_vect_usart0_rx
+#define USART0_UDRE_vect  sim_vect_usart0_udre
+#define USART2_RX_vect    sim_vect_usart2_rx
+#define USART2_UDRE_vect  sim_vect_usart2_udre
+#define ADC_vect          sim_vect_adc
+
+// Interrupts are only ever taken where the simulator decides, so these are no-ops.
+#define sei() do { } while(0)
+#define cli() do { } while(0)
+
+#endif // _SIM_AVR_INTERRUPT_H_
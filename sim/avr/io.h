@@ -0,0 +1,85 @@
+#ifndef _SIM_AVR_IO_H_
+#define _SIM_AVR_IO_H_
+/* Host simulator stand-in for <avr/io.h>.
+ * Only the ATmega2560 registers the firmware core actually uses are present.
+ */
+
+#include "SimAvr.h"
+
+#define _SFR_MEM8(mem_addr) (sim_io[(mem_addr)])
+
+// Ports, addressed the same way AvrPort does (PINx, DDRx, PORTx).
+#define PINB  _SFR_MEM8(0x23)
+#define DDRB  _SFR_MEM8(0x24)
+#define PORTB _SFR_MEM8(0x25)
+#define PINC  _SFR_MEM8(0x26)
+#define DDRC  _SFR_MEM8(0x27)
+#define PORTC _SFR_MEM8(0x28)
+#define PINK  _SFR_MEM8(0x106)
+#define DDRK  _SFR_MEM8(0x107)
+#define PORTK _SFR_MEM8(0x108)
+#define DDB0 0
+#define DDB1 1
+#define DDB2 2
+#define DDB3 3
+
+// Power reduction
+extern SimReg8 PRR0, PRR1;
+#define PRTIM1   3
+#define PRUSART0 1
+#define PRUSART2 1
+
+// Timer0 (millis)
+extern SimReg8 TCCR0B, TIMSK0, TIFR0, TCNT0;
+#define CS00  0
+#define CS01  1
+#define TOIE0 0
+#define TOV0  0
+
+// Timer1 (stepper)
+extern SimReg8 TCCR1A, TCCR1B, TIFR1, TIMSK1;
+extern volatile uint16_t OCR1A, TCNT1;
+#define WGM10  0
+#define WGM11  1
+#define WGM12  3
+#define WGM13  4
+#define CS10   0
+#define OCF1A  1
+#define OCIE1A 1
+
+// Timer5 (ISR_PROFILE); counts simulated cycles.  Those don't pass inside a
+// handler, so every handler profiles at 0 cycles here.
+extern SimReg8 TCCR5A, TCCR5B;
+#define TCNT5 ((uint16_t)sim_cycles)
+#define CS50   0
+
+// USART0 / USART2
+extern SimReg8 UCSR0A, UCSR0B, UCSR0C, UDR0;
+extern SimReg8 UCSR2A, UCSR2B, UCSR2C, UDR2;
+extern volatile uint16_t UBRR0, UBRR2;
+#define RXCIE0 7
+#define UDRIE0 5
+#define RXEN0  4
+#define TXEN0  3
+#define U2X0   1
+#define UCSZ01 2
+#define UCSZ00 1
+#define RXCIE2 7
+#define UDRIE2 5
+#define RXEN2  4
+#define TXEN2  3
+#define U2X2   1
+#define UCSZ21 2
+#define UCSZ20 1
+
+// ADC
+extern SimReg8 ADCSRA, ADCSRB, ADMUX, ADCL, ADCH;
+#define ADPS0 0
+#define ADPS1 1
+#define ADPS2 2
+#define ADIE  3
+#define ADSC  6
+#define ADEN  7
+#define MUX5  3
+
+#endif // _SIM_AVR_IO_H_
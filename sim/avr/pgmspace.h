@@ -0,0 +1,16 @@
+#ifndef _SIM_AVR_PGMSPACE_H_
+#define _SIM_AVR_PGMSPACE_H_
+/* Host simulator stand-in for <avr/pgmspace.h>; flash is just memory here. */
+
+#include <stdint.h>
+#include <string.h>
+
+#define PROGMEM
+#define PSTR(s) (s)
+#define pgm_read_byte(addr)  (*(const uint8_t*)(addr))
+#define pgm_read_word(addr)  (*(const uint16_t*)(addr))
+#define pgm_read_dword(addr) (*(const uint32_t*)(addr))
+#define strlen_P(s) strlen(s)
+#define strcmp_P(a,b) strcmp((a),(b))
+
+#endif // _SIM_AVR_PGMSPACE_H_
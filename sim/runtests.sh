@@ -0,0 +1,57 @@
+#!/bin/sh
+###########################
+# Regression checks for the simulator; run with "make -C sim check".
+#
+# Each tests/NAME.gcode is run through sjfw-sim -v, and what the firmware
+# sent back plus the step counts are compared with tests/NAME.out.  Extra
+# sjfw-sim options can go on the first line, as "; sim: -B".  A tests/NAME.sh
+# is run instead with SIM set to the simulator, for checks that need more
+# than one run or a host tool; its output is compared the same way.
+#
+# The host CPU timings change from run to run, so those lines are left out.
+#
+#   ./runtests.sh          run them all
+#   ./runtests.sh -u NAME  write NAME.out from what it gives now
+###########################
+
+cd "$(dirname "$0")" || exit 2
+SIM=$(pwd)/sjfw-sim
+export SIM
+
+run()
+{
+	case "$1" in
+		*.sh) sh "$1" ;;
+		*)
+			opts=$(sed -n '1s/^; sim://p' "$1")
+			$SIM -v $opts "$1"
+			;;
+	esac 2>&1 | grep -v '^parse: \|^plan: '
+}
+
+if [ "$1" = "-u" ]; then
+	shift
+	for t in "$@"; do
+		for f in tests/$t.gcode tests/$t.sh; do
+			[ -f "$f" ] && run "$f" > tests/$t.out
+		done
+	done
+	exit 0
+fi
+
+pass=0
+fail=0
+for f in tests/*.gcode tests/*.sh; do
+	[ -f "$f" ] || continue
+	t=${f%.*}
+	if run "$f" | diff -u "$t.out" - > "$t.diff"; then
+		rm -f "$t.diff"
+		pass=$((pass + 1))
+	else
+		echo "FAIL: $f (see sim/$t.diff)"
+		fail=$((fail + 1))
+	fi
+done
+
+echo "$pass passed, $fail failed"
+[ $fail -eq 0 ]
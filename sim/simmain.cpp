@@ -0,0 +1,524 @@
+/* Host-native simulator / benchmark for the sjfw motion pipeline.
+ *
+ * Feeds a G-code file through GcodeQueue::parsebytes the same way
+ * Host::scan_input does (one whitespace-delimited fragment per mainloop pass),
+ * runs the mainloop against the fake AVR layer in SimAvr.cpp, and reports
+ *  - parse throughput (lines/sec of host CPU spent in parsebytes),
+ *  - planning throughput (moves/sec of host CPU spent in parsebytes + handlenext),
+ *  - simulated print time, step counts and step rates in AVR cycles.
+ *
+ * Host CPU figures are only good for comparing one build against another;
+ * the simulated figures are what the chip would see, given the -l and -i costs.
+ *
+ * With -B the file is sent as binary packets after an M321, as a host would;
+ * see GcodeQueue.h.  They're numbered from 1, or from -N's line number.
+ *
+ * With -S the file goes in through Host's receive buffer a byte at a time, as
+ * the USART interrupt would put it there, and Host::scan_input takes it from
+ * there; so real-time codes are picked out of what's waiting the way they are
+ * on the printer.  The host keeps the buffer as full as it can.
+ *
+ * With -e, an axis' min or max endstop closes once the axis steps that far
+ * from where the sim started, e.g. -e Xmax:10.
+ *
+ * usage: sjfw-sim [-b baud] [-l loopcycles] [-i isrcycles] [-e Xmax:mm] [-n] [-v] [-B] [-N line] [-S] file.gcode
+ */
+
+#include "GcodeQueue.h"
+#include "Motion.h"
+#include "Host.h"
+#include "Temperature.h"
+#include "config.h"
+#include "SimAvr.h"
+#include "IsrProfile.h"
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <vector>
+#include <string>
+
+// Host.cpp's receive interrupt, for -S.
+extern "C" void USART0_RX_vect(void);
+
+// Longest we will let a print run, in simulated seconds, before giving up.
+#define SIM_MAX_SECONDS (7UL * 24 * 3600)
+
+static bool verbose = false;
+
+static void uart_out(uint8_t c)
+{
+  if(verbose)
+    putchar(c);
+}
+
+static double now()
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+
+/*** Step pulse accounting ***/
+// Steps can come in bursts of several per interrupt, so peak rate is
+// measured as the most steps seen in any one millisecond.  The shortest step
+// high and low times and DIR setup time (DIR change to step) are kept too, to
+// check them against the drivers' minimums; see STEP_PULSE_US and
+// STEP_DIR_DELAY_US.
+#define STEP_WINDOW (F_CPU / 1000)
+#define NO_TIME (~(uint64_t)0)
+struct StepStats
+{
+  uint16_t addr, diraddr;
+  uint8_t  bit, dirbit;
+  uint64_t steps;
+  uint64_t window;
+  uint32_t inwindow;
+  uint32_t peak;
+  uint64_t rose, fell, turned;
+  uint64_t minhigh, minlow, minsetup;
+  bool     forward;  // DIR pin says so
+  int64_t  position; // in steps, from where the sim started
+};
+static StepStats stepstats[NUM_AXES];
+
+
+/*** Endstops ***/
+// -e Xmax:10 closes X's max endstop whenever X is 10mm or more forward of
+// where the sim started, and Xmin:-5 its min endstop at 5mm or more back.
+struct Endstop
+{
+  uint8_t  axis;
+  bool     max;
+  int64_t  at;    // in steps
+  uint16_t addr;  // PORTx
+  uint8_t  bit;
+};
+static Endstop endstops[NUM_AXES * 2];
+static int num_endstops = 0;
+
+static bool add_endstop(const char* arg)
+{
+  static const char names[] = "XYZE";
+  Pin mins[NUM_AXES] = { X_MIN_PIN, Y_MIN_PIN, Z_MIN_PIN, Pin() };
+  Pin maxs[NUM_AXES] = { X_MAX_PIN, Y_MAX_PIN, Z_MAX_PIN, Pin() };
+  float spu[NUM_AXES] = { X_STEPS_PER_UNIT, Y_STEPS_PER_UNIT, Z_STEPS_PER_UNIT, A_STEPS_PER_UNIT };
+
+  const char* ax = strchr(names, arg[0]);
+  if(!arg[0] || !ax || num_endstops == NUM_AXES * 2)
+    return false;
+  Endstop& e = endstops[num_endstops];
+  e.axis = ax - names;
+  if(!strncmp(arg + 1, "max:", 4))
+    e.max = true;
+  else if(!strncmp(arg + 1, "min:", 4))
+    e.max = false;
+  else
+    return false;
+  Pin p = e.max ? maxs[e.axis] : mins[e.axis];
+  if(p.isNull())
+    return false;
+  e.at = (int64_t)(strtod(arg + 5, NULL) * spu[e.axis] + 0.5);
+  e.addr = p.getPortIndex() + 2;
+  e.bit = p.getPinIndex();
+  num_endstops++;
+  return true;
+}
+
+// An endstop reads as hit when its pin isn't at ENDSTOPS_INVERTING; see
+// Axis::takeStep.
+static void check_endstops(int axis)
+{
+  for(int x=0;x<num_endstops;x++)
+  {
+    Endstop& e = endstops[x];
+    if(e.axis != axis)
+      continue;
+    int64_t pos = stepstats[axis].position;
+    if(e.max ? pos >= e.at : pos <= e.at)
+      sim_drive_pin(e.addr, e.bit, !ENDSTOPS_INVERTING);
+    else
+      sim_release_pin(e.addr, e.bit);
+  }
+}
+
+static void step_edge(int axis, bool high)
+{
+  StepStats& s = stepstats[axis];
+  if(!high)
+  {
+    if(sim_cycles - s.rose < s.minhigh)
+      s.minhigh = sim_cycles - s.rose;
+    s.fell = sim_cycles;
+    return;
+  }
+  if(s.fell != NO_TIME && sim_cycles - s.fell < s.minlow)
+    s.minlow = sim_cycles - s.fell;
+  if(s.turned != NO_TIME && sim_cycles - s.turned < s.minsetup)
+    s.minsetup = sim_cycles - s.turned;
+  s.rose = sim_cycles;
+  s.position += s.forward ? 1 : -1;
+  check_endstops(axis);
+
+  if(sim_cycles / STEP_WINDOW != s.window)
+  {
+    s.window = sim_cycles / STEP_WINDOW;
+    s.inwindow = 0;
+  }
+  if(++s.inwindow > s.peak)
+    s.peak = s.inwindow;
+  s.steps++;
+}
+
+static void pin_edge(uint16_t addr, uint8_t bit, bool high)
+{
+  static const bool invert[NUM_AXES] = { X_INVERT_DIR, Y_INVERT_DIR, Z_INVERT_DIR, A_INVERT_DIR };
+  for(int ax=0;ax<NUM_AXES;ax++)
+  {
+    StepStats& s = stepstats[ax];
+    if(s.addr == addr && s.bit == bit)
+      step_edge(ax, high);
+    else if(s.diraddr == addr && s.dirbit == bit)
+    {
+      s.turned = sim_cycles;
+      s.forward = high != invert[ax];
+    }
+  }
+}
+
+static void watch_steps()
+{
+  Pin pins[NUM_AXES] = { X_STEP_PIN, Y_STEP_PIN, Z_STEP_PIN, A_STEP_PIN };
+  Pin dirs[NUM_AXES] = { X_DIR_PIN, Y_DIR_PIN, Z_DIR_PIN, A_DIR_PIN };
+  for(int ax=0;ax<NUM_AXES;ax++)
+  {
+    StepStats& s = stepstats[ax];
+    s.rose = s.fell = s.turned = NO_TIME;
+    s.minhigh = s.minlow = s.minsetup = NO_TIME;
+    s.position = 0;
+    if(pins[ax].isNull())
+      continue;
+    // PORTx is the third register of each port block; see AvrPort.h
+    s.addr = pins[ax].getPortIndex() + 2;
+    s.bit = pins[ax].getPinIndex();
+    sim_watch_pin(s.addr, s.bit, pin_edge);
+    if(dirs[ax].isNull())
+      continue;
+    s.diraddr = dirs[ax].getPortIndex() + 2;
+    s.dirbit = dirs[ax].getPinIndex();
+    s.forward = (sim_io[s.diraddr].v & _BV(s.dirbit)) != 0;
+    sim_watch_pin(s.diraddr, s.dirbit, pin_edge);
+  }
+}
+
+static void print_us(const char* label, uint64_t cycles)
+{
+  if(cycles != NO_TIME)
+    printf(", %s %.2f us", label, (double)cycles * 1000000 / F_CPU);
+}
+
+
+/*** Input ***/
+// One line as the host would send it: comments stripped, newline terminated.
+struct Line
+{
+  std::string text;
+  bool ismove;
+  bool realtime; // goes in even with the queue full, as Host::realtimeWaiting
+};
+
+static bool load(const char* fn, std::vector<Line>& lines)
+{
+  FILE* f = fopen(fn, "r");
+  if(!f)
+    return false;
+  char buf[1024];
+  while(fgets(buf, sizeof(buf), f))
+  {
+    Line l;
+    int paren = 0;
+    for(char* p = buf; *p && *p != ';' && *p != '\n' && *p != '\r'; p++)
+    {
+      if(*p == '(') paren++;
+      else if(*p == ')') { if(paren) paren--; }
+      else if(!paren) l.text += *p;
+    }
+    while(!l.text.empty() && l.text[l.text.size()-1] <= ' ')
+      l.text.erase(l.text.size()-1);
+    if(l.text.empty())
+      continue;
+    l.ismove = false;
+    l.realtime = false;
+    for(size_t x=0;x<l.text.size();x++)
+    {
+      if(l.text[x] == 'M' && (x == 0 || l.text[x-1] == ' '))
+      {
+        l.realtime = GCode::isRealtime(strtol(l.text.c_str() + x + 1, NULL, 10));
+        break;
+      }
+      if(l.text[x] == 'G' && (x == 0 || l.text[x-1] == ' '))
+      {
+        long g = strtol(l.text.c_str() + x + 1, NULL, 10);
+        l.ismove = (g >= 0 && g <= 3);
+        break;
+      }
+    }
+    l.text += '\n';
+    lines.push_back(l);
+  }
+  fclose(f);
+  return true;
+}
+
+
+/*** Binary packets ***/
+static uint16_t crc16_update(uint16_t crc, uint8_t data)
+{
+  crc ^= (uint16_t)data << 8;
+  for(int x=0;x<8;x++)
+    crc = (crc & 0x8000) ? (crc << 1) ^ 0x1021 : crc << 1;
+  return crc;
+}
+
+static std::string encode(const std::string& text, uint16_t linenum)
+{
+  const char* vals[26] = { 0 };
+  uint32_t present = 0;
+  for(size_t x=0;x<text.size();x++)
+  {
+    char l = text[x];
+    if(l < 'A' || l > 'Z' || (x && text[x-1] != ' '))
+      continue;
+    vals[l - 'A'] = text.c_str() + x + 1;
+    present |= 1UL << (l - 'A');
+  }
+  bool intaxes = vals['M' - 'A'] && strtol(vals['M' - 'A'], NULL, 10) >= 300;
+
+  std::string payload;
+  payload += (char)(linenum & 0xFF);
+  payload += (char)(linenum >> 8);
+  for(int x=0;x<4;x++)
+    payload += (char)(present >> (8 * x));
+  for(int x=0;x<26;x++)
+  {
+    if(!vals[x])
+      continue;
+    char l = 'A' + x;
+    char b[4];
+    if(GCode::isIntParam(l) || (intaxes && strchr("XYZE", l)))
+    {
+      int32_t v = strtol(vals[x], NULL, 10);
+      memcpy(b, &v, 4);
+    }
+    else
+    {
+      float v = strtof(vals[x], NULL);
+      memcpy(b, &v, 4);
+    }
+    payload.append(b, 4);
+  }
+
+  std::string packet;
+  packet += (char)PACKET_SYNC;
+  packet += (char)payload.size();
+  packet += payload;
+  uint16_t crc = 0xFFFF;
+  for(size_t x=1;x<packet.size();x++)
+    crc = crc16_update(crc, packet[x]);
+  packet += (char)(crc & 0xFF);
+  packet += (char)(crc >> 8);
+  return packet;
+}
+
+
+int main(int argc, char** argv)
+{
+  unsigned long baud = 0;
+  uint32_t loopcycles = 2000;
+  bool optimize = true;
+  bool binary = false;
+  uint16_t firstline = 1;
+  bool serial = false;
+  int opt;
+  while((opt = getopt(argc, argv, "b:l:i:e:nvBN:S")) != -1)
+  {
+    switch(opt)
+    {
+      case 'b': baud = strtoul(optarg, NULL, 10); break;
+      case 'l': loopcycles = strtoul(optarg, NULL, 10); break;
+      case 'i': sim_isr_cost = strtoul(optarg, NULL, 10); break;
+      case 'n': optimize = false; break;
+      case 'v': verbose = true; break;
+      case 'B': binary = true; break;
+      case 'N': firstline = strtoul(optarg, NULL, 10); break;
+      case 'S': serial = true; break;
+      case 'e':
+        if(add_endstop(optarg))
+          break;
+        fprintf(stderr, "bad endstop %s; want e.g. Xmax:10\n", optarg);
+        return 2;
+      default:
+        fprintf(stderr, "usage: %s [-b baud] [-l loopcycles] [-i isrcycles] [-e Xmax:mm] [-n] [-v] [-B] [-N line] [-S] file.gcode\n", argv[0]);
+        return 2;
+    }
+  }
+  if(optind >= argc)
+  {
+    fprintf(stderr, "no gcode file given\n");
+    return 2;
+  }
+
+  std::vector<Line> lines;
+  if(!load(argv[optind], lines))
+  {
+    perror(argv[optind]);
+    return 1;
+  }
+
+  sim_init(uart_out);
+  watch_steps();
+#ifdef ISR_PROFILE
+  isrprofile::init();
+#endif
+  if(optimize)
+    GCODES.enableOptimize();
+
+  // 10 bits per byte on the wire; the host sends the next line once it sees "ok".
+  uint64_t cycles_per_byte = baud ? (uint64_t)F_CPU * 10 / baud : 0;
+  uint64_t line_ready = 0;
+  size_t   curline = 0, curpos = 0;
+  unsigned long moves = 0, passes = 0;
+
+  double parse_time = 0, plan_time = 0;
+  uint64_t stepper_idle = 0, queue_empty = 0;
+
+  if(binary)
+  {
+    for(size_t x=0;x<lines.size();x++)
+      lines[x].text = encode(lines[x].text, firstline + x);
+    char m321[] = "M321";
+    m321[4] = '\n';
+    GCODES.parsebytes(m321, 4, HOST_SOURCE);
+    GCODES.setLineNumber(firstline, HOST_SOURCE);
+  }
+
+  if(serial)
+    line_ready = cycles_per_byte;
+  else if(!lines.empty())
+    line_ready = (uint64_t)lines[0].text.size() * cycles_per_byte;
+
+  for(;;passes++)
+  {
+    double t = now();
+    GCODES.handlenext();
+    GCODES.checkaxes();
+    plan_time += now() - t;
+
+    if(serial)
+    {
+      // Whatever the host has sent by now, as far as there's room for it; in
+      // serial mode line_ready is when the next byte is in.
+      while(curline < lines.size() && sim_cycles >= line_ready && HOST.rxchars() < HOST_RECV_BUFSIZE - 1)
+      {
+        const std::string& s = lines[curline].text;
+        UDR0.v = s[curpos++];
+        USART0_RX_vect();
+        line_ready += cycles_per_byte;
+        if(curpos >= s.size())
+        {
+          if(lines[curline].ismove)
+            moves++;
+          curline++;
+          curpos = 0;
+        }
+      }
+      if(line_ready < sim_cycles)
+        line_ready = sim_cycles;
+
+      t = now();
+      HOST.scan_input();
+      parse_time += now() - t;
+
+      if(curline >= lines.size() && !HOST.rxchars() && GCODES.isEmpty() && MOTION.isBufferEmpty())
+        break;
+    }
+    else if(binary && curline < lines.size() && sim_cycles >= line_ready && (!GCODES.isFull() || lines[curline].realtime))
+    {
+      t = now();
+      GCODES.parsepacket((uint8_t*)lines[curline].text.data() + 1, HOST_SOURCE);
+      parse_time += now() - t;
+      if(lines[curline].ismove)
+        moves++;
+      curline++;
+      if(curline < lines.size())
+        line_ready = sim_cycles + (4 + lines[curline].text.size()) * cycles_per_byte;
+    }
+    // Same fragmenting as Host::scan_input.
+    else if(!binary && curline < lines.size() && sim_cycles >= line_ready && (!GCODES.isFull() || lines[curline].realtime))
+    {
+      const std::string& s = lines[curline].text;
+      char buf[MAX_GCODE_FRAG_SIZE];
+      uint8_t len = 0;
+      while(len < MAX_GCODE_FRAG_SIZE - 1 && s[curpos] > 32)
+        buf[len++] = s[curpos++];
+      buf[len] = s[curpos++];
+
+      t = now();
+      GCODES.parsebytes(buf, len, HOST_SOURCE);
+      parse_time += now() - t;
+
+      while(curpos < s.size() && s[curpos] == ' ')
+        curpos++;
+      if(curpos >= s.size())
+      {
+        if(lines[curline].ismove)
+          moves++;
+        curline++;
+        curpos = 0;
+        if(curline < lines.size())
+          line_ready = sim_cycles + (4 + lines[curline].text.size()) * cycles_per_byte;
+      }
+    }
+    else if(curline >= lines.size() && GCODES.isEmpty() && MOTION.isBufferEmpty())
+      break;
+
+    uint64_t before = sim_cycles;
+    uint64_t off = sim_t1_off_cycles;
+    bool empty = GCODES.isEmpty() && MOTION.isBufferEmpty();
+    sim_run_cpu(loopcycles);
+    if(!empty)
+      stepper_idle += sim_t1_off_cycles - off;
+    if(empty && curline < lines.size())
+      queue_empty += sim_cycles - before;
+
+    if(sim_cycles / F_CPU > SIM_MAX_SECONDS)
+    {
+      fprintf(stderr, "giving up after %lu simulated seconds\n", SIM_MAX_SECONDS);
+      return 1;
+    }
+  }
+
+  double simsecs = (double)sim_cycles / F_CPU;
+  printf("lines:        %lu (%lu moves)\n", (unsigned long)lines.size(), moves);
+  printf("parse:        %.3f s host, %.0f lines/s\n", parse_time, parse_time > 0 ? lines.size() / parse_time : 0);
+  printf("plan:         %.3f s host in handlenext over %lu passes, %.0f moves/s (parse + handlenext)\n",
+          plan_time, passes, parse_time + plan_time > 0 ? moves / (parse_time + plan_time) : 0);
+  printf("print time:   %.3f s simulated\n", simsecs);
+  printf("timer1 isrs:  %llu, %.1f%% cpu at %lu cycles each\n", (unsigned long long)sim_isr_count,
+          sim_cycles ? 100.0 * sim_isr_cycles / sim_cycles : 0, (unsigned long)sim_isr_cost);
+  printf("stepper idle: %.3f s with codes queued\n", (double)stepper_idle / F_CPU);
+  printf("queue empty:  %.3f s waiting on input\n", (double)queue_empty / F_CPU);
+  for(int ax=0;ax<NUM_AXES;ax++)
+  {
+    StepStats& s = stepstats[ax];
+    printf("axis %d:       %llu steps", ax, (unsigned long long)s.steps);
+    if(s.steps)
+      printf(", peak %lu steps/s", (unsigned long)s.peak * (F_CPU / STEP_WINDOW));
+    print_us("high", s.minhigh);
+    print_us("low", s.minlow);
+    print_us("dir setup", s.minsetup);
+    printf("\n");
+  }
+  return 0;
+}
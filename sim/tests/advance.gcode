@@ -0,0 +1,12 @@
+; Linear advance adds extruder steps in accel and takes them back in decel,
+; turning DIR round for them.  They must keep STEP_PULSE_US low time after
+; the move's steps and STEP_DIR_DELAY_US DIR setup.
+M900 K0.05
+G21
+G90
+G92 X0 Y0 Z0 E0
+G1 X70 Y50 E0.5 F6000
+G1 X20 Y50 E1.5
+G1 X20 Y10 E2.0 F3000
+G1 X60 Y10 E2.8 F9000
+M114
@@ -0,0 +1,24 @@
+; G2/G3 arcs: centre offsets, R (both ways round), full circles, another
+; plane, and a full circle whose end only matches its start to the step.
+G21
+G90
+G92 X0 Y0 Z0 E0
+G1 X10 Y0 F3000
+G2 X0 Y-10 I-10 J0 E1
+M114
+G3 X10 Y0 R10 E2
+M114
+G2 X0 Y-10 R-10 E3
+M114
+G3 X0 Y-10 I0 J5 E4
+M114
+G18
+G2 X5 Z5 I5 K0
+M114
+G17
+G1 X10 Y10.005 Z0
+G3 X10 Y10.005 I5 J0
+M114
+M212 S0.1
+G2 X10 Y10.005 I5 J0
+M114
@@ -0,0 +1,7 @@
+; Fast enough that several steps go out per interrupt; the step high and low
+; times must still be STEP_PULSE_US.
+M200 X200 Y200
+M206 X2000 Y2000
+G1 X100 Y50 F12000
+G1 X0 Y0
+M114
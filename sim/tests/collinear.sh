@@ -0,0 +1,21 @@
+# Collinear G1s merged into one move (MERGE_TOLERANCE, M213): 500 0.1mm
+# segments in a straight line, then a 20mm-radius quarter circle in 0.1mm
+# chords, once as they come and once with merging off.  Both have to end at
+# the same place with the same steps; merged, the line runs at its feed
+# instead of crawling from segment to segment.
+g=$(mktemp)
+trap 'rm -f "$g" "$g.off"' EXIT
+awk 'BEGIN {
+	print "G21"; print "G90"; print "G92 X0 Y0 Z0 E0"
+	for(i = 1; i <= 500; i++)
+		printf("G1 X%.3f Y%.3f E%.4f F3000\n", i * 0.08, i * 0.06, i * 0.004)
+	print "M114"
+	for(i = 1; i <= 314; i++)
+		printf("G1 X%.3f Y%.3f E%.4f\n", 40 + 20 * sin(i / 200), 30 + 20 - 20 * cos(i / 200), 2 + i * 0.004)
+	print "M114"
+}' > "$g"
+{ echo "M213 P0"; cat "$g"; } > "$g.off"
+
+for f in "$g" "$g.off"; do
+	$SIM -v "$f" | grep -v '^ok'
+done
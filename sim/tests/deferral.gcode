@@ -0,0 +1,67 @@
+; sim: -b 14400
+; Short zigzag moves from a host only just keeping up, so the steppers keep
+; getting down to their last couple of ms with new moves to replan, and
+; M313 counts the replans put off.
+G21
+G90
+G1 X0.2 Y0.1 F800
+G1 X0.4 Y0.0 F800
+G1 X0.6 Y0.1 F800
+G1 X0.8 Y0.0 F800
+G1 X1.0 Y0.1 F800
+G1 X1.2 Y0.0 F800
+G1 X1.4 Y0.1 F800
+G1 X1.6 Y0.0 F800
+G1 X1.8 Y0.1 F800
+G1 X2.0 Y0.0 F800
+G1 X2.2 Y0.1 F800
+G1 X2.4 Y0.0 F800
+G1 X2.6 Y0.1 F800
+G1 X2.8 Y0.0 F800
+G1 X3.0 Y0.1 F800
+G1 X3.2 Y0.0 F800
+G1 X3.4 Y0.1 F800
+G1 X3.6 Y0.0 F800
+G1 X3.8 Y0.1 F800
+G1 X4.0 Y0.0 F800
+G1 X4.2 Y0.1 F800
+G1 X4.4 Y0.0 F800
+G1 X4.6 Y0.1 F800
+G1 X4.8 Y0.0 F800
+G1 X5.0 Y0.1 F800
+G1 X5.2 Y0.0 F800
+G1 X5.4 Y0.1 F800
+G1 X5.6 Y0.0 F800
+G1 X5.8 Y0.1 F800
+G1 X6.0 Y0.0 F800
+G1 X6.2 Y0.1 F800
+G1 X6.4 Y0.0 F800
+G1 X6.6 Y0.1 F800
+G1 X6.8 Y0.0 F800
+G1 X7.0 Y0.1 F800
+G1 X7.2 Y0.0 F800
+G1 X7.4 Y0.1 F800
+G1 X7.6 Y0.0 F800
+G1 X7.8 Y0.1 F800
+G1 X8.0 Y0.0 F800
+G1 X8.2 Y0.1 F800
+G1 X8.4 Y0.0 F800
+G1 X8.6 Y0.1 F800
+G1 X8.8 Y0.0 F800
+G1 X9.0 Y0.1 F800
+G1 X9.2 Y0.0 F800
+G1 X9.4 Y0.1 F800
+G1 X9.6 Y0.0 F800
+G1 X9.8 Y0.1 F800
+G1 X10.0 Y0.0 F800
+G1 X10.2 Y0.1 F800
+G1 X10.4 Y0.0 F800
+G1 X10.6 Y0.1 F800
+G1 X10.8 Y0.0 F800
+G1 X11.0 Y0.1 F800
+G1 X11.2 Y0.0 F800
+G1 X11.4 Y0.1 F800
+G1 X11.6 Y0.0 F800
+G1 X11.8 Y0.1 F800
+G1 X12.0 Y0.0 F800
+M313
@@ -0,0 +1,12 @@
+; sim: -e Xmax:10
+; The X max endstop closes at X10 partway through the first move.  Each move
+; after it then starts somewhere other than planned and is rebased, and the
+; corner after a rebased move is planned from its new shape.
+G21
+G90
+G92 X0 Y0
+G1 X20 F3000
+G1 X30 Y10
+G1 X40 Y0
+G1 X45 Y5
+M114
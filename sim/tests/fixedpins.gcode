@@ -0,0 +1,7 @@
+; ramps13 has FIXED_STEP_PINS, so step and endstop pin remaps are refused and
+; the moves still step the configured pins.
+M300 X54 Y60
+M304 X3
+M305 Z7
+G1 X1 Y1 F1200
+M114
@@ -0,0 +1,8 @@
+; M311 after two moves, then again once P1 has cleared the counts.  The sim
+; charges nothing for a handler but its delays, so step shows the pulse width.
+G21
+G90
+G1 X10 Y5 F3000
+G1 X0 Y0
+M311 P1
+M311
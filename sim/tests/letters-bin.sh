@@ -0,0 +1,9 @@
+# A binary packet with more letters than a GCode has room for is refused.
+g=$(mktemp)
+trap 'rm -f "$g"' EXIT
+cat > "$g" <<'GCODE'
+G21
+G1 X5 F3000
+G1 X1 Y1 Z1 E1 F100 A1 B1 C1 D1 H1 K1
+GCODE
+$SIM -v -B "$g"
@@ -0,0 +1,14 @@
+; Parameter letters: a word that is not a letter and a number is noise, and a
+; letter given twice or more letters than fit spoil the line, which is
+; acknowledged but not run.  Binary packets with too many letters are refused.
+G21
+G90
+G1 X10 Y5 F3000
+G1 X20 Layer Y10
+M114
+G1 X30 X40
+M114
+G1 X1 Y1 Z1 E1 F100 A1 B1 C1 D1 H1 K1
+M114
+G1 X25 Y10 Z0.5 E1 F3000
+M114
@@ -0,0 +1,13 @@
+; Straight moves, relative moves and G92, with where M114 says they ended.
+G21
+G90
+G1 X10 Y5 F3000
+G1 X20 Y20 Z0.5 E1
+M114
+G91
+G1 X-5 Y-5 E0.5
+G90
+M114
+G92 X0 Y0 E0
+G1 X2.5 Y2.5 E0.1
+M114
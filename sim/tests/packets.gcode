@@ -0,0 +1,12 @@
+; sim: -B -N 65532
+; Binary packets numbered past 32767 and round through 65535 to 0, with
+; M114 to show the moves all went in.
+G21
+G90
+G1 X10 Y5 F3000
+M114
+G1 X20 Y20 Z0.5 E1
+M114
+G92 X0 Y0 E0
+G1 X2.5 Y2.5 E0.1
+M114
@@ -0,0 +1,2 @@
+# tests/realtime.gcode again, as binary packets.
+$SIM -v -S -B -b 115200 tests/realtime.gcode
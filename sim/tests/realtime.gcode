@@ -0,0 +1,90 @@
+; sim: -S -b 115200
+; Real-time codes through the receive buffer: each is run as soon as it
+; has all come in, ahead of the moves waiting in front of it.  The M112,
+; padded past any fragment, says how many lines it threw away.
+G21
+G90
+G1 X10 Y10 F3000
+G1 X20 Y0 F3000
+G1 X30 Y10 F3000
+G1 X40 Y0 F3000
+G1 X50 Y10 F3000
+G1 X60 Y0 F3000
+M222 S50
+G1 X70 Y10
+G1 X80 Y0
+G1 X90 Y10
+G1 X0 Y0
+G1 X10 Y10
+G1 X20 Y0
+G1 X30 Y10
+G1 X40 Y0
+G1 X50 Y10
+G1 X60 Y0
+G1 X70 Y10
+G1 X80 Y0
+G1 X90 Y10
+G1 X0 Y0
+G1 X10 Y10
+G1 X20 Y0
+G1 X30 Y10
+G1 X40 Y0
+G1 X50 Y10
+G1 X60 Y0
+M114
+M222 S100
+G1 X70 Y10
+G1 X80 Y0
+G1 X90 Y10
+G1 X0 Y0
+G1 X10 Y10
+G1 X20 Y0
+G1 X30 Y10
+G1 X40 Y0
+G1 X50 Y10
+G1 X60 Y0
+G1 X70 Y10
+G1 X80 Y0
+G1 X90 Y10
+G1 X0 Y0
+G1 X10 Y10
+G1 X20 Y0
+G1 X30 Y10
+G1 X40 Y0
+G1 X50 Y10
+G1 X60 Y0
+G1 X70 Y10
+G1 X80 Y0
+G1 X90 Y10
+G1 X0 Y0
+G1 X10 Y10
+G1 X20 Y0
+G1 X30 Y10
+G1 X40 Y0
+G1 X50 Y10
+G1 X60 Y0
+G1 X70 Y10
+G1 X80 Y0
+G1 X90 Y10
+G1 X0 Y0
+G1 X10 Y10
+G1 X20 Y0
+G1 X30 Y10
+G1 X40 Y0
+G1 X50 Y10
+G1 X60 Y0
+G1 X70 Y10
+G1 X80 Y0
+G1 X90 Y10
+G1 X0 Y0
+G1 X10 Y10
+G1 X20 Y0
+G1 X30 Y10
+G1 X40 Y0
+G1 X50 Y10
+G1 X60 Y0
+M112                                                    S0
+M114
+G1 X5 Y5
+M114
+
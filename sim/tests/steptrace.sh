@@ -0,0 +1,19 @@
+# M312 after two short moves, decoded by util/steptrace.pl both ways.  The
+# moves are numbered so the summary has line numbers to show, and short enough
+# that the whole of both fits in the trace.
+g=$(mktemp)
+trap 'rm -f "$g" "$g.log" "$g.csv"' EXIT
+cat > "$g" <<'GCODE'
+G21
+G90
+N0 G1 X2 Y1 F3000*79
+N1 G1 X0 Y0*40
+N2 M312*33
+GCODE
+
+$SIM -v "$g" > "$g.log"
+perl ../util/steptrace.pl "$g.log"
+perl ../util/steptrace.pl -c "$g.log" > "$g.csv"
+head -4 "$g.csv"
+tail -1 "$g.csv"
+echo "$(wc -l < "$g.csv") csv lines"
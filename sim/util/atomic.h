@@ -0,0 +1,14 @@
+#ifndef _SIM_UTIL_ATOMIC_H_
+#define _SIM_UTIL_ATOMIC_H_
+/* Host simulator stand-in for <util/atomic.h>.
+ * The simulator never preempts mainloop code in the middle of a statement,
+ * so an atomic block is just a block.
+ */
+
+#include <avr/interrupt.h>
+
+#define ATOMIC_RESTORESTATE 0
+#define ATOMIC_FORCEON      1
+#define ATOMIC_BLOCK(type) for(uint8_t __sim_atomic = 1; __sim_atomic; __sim_atomic = 0)
+
+#endif // _SIM_UTIL_ATOMIC_H_
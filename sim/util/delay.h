@@ -0,0 +1,10 @@
+#ifndef _SIM_UTIL_DELAY_H_
+#define _SIM_UTIL_DELAY_H_
+/* Host simulator stand-in for <util/delay.h>; busy waits burn simulated time. */
+
+#include "SimAvr.h"
+
+inline void _delay_us(double us) { sim_run_cpu((uint32_t)(us * (F_CPU / 1000000L))); }
+inline void _delay_ms(double ms) { sim_run_cpu((uint32_t)(ms * (F_CPU / 1000L))); }
+
+#endif // _SIM_UTIL_DELAY_H_
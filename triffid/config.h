@@ -78,6 +78,23 @@
 #define A_LENGTH        110
 #define A_DISABLE       false
 
+// The step and endstop pins again, as compile-time types so the step interrupt
+// can set them with single instructions.  They must match the Pin()s above,
+// so M300, M304 and M305 are refused rather than moving only some of them.
+#define FIXED_STEP_PINS
+#define X_STEP_FIXED  FixedPin<PORTBASE_E,4>
+#define X_MIN_FIXED   FixedPin<PORTBASE_H,1>
+#define X_MAX_FIXED   NoFixedPin
+#define Y_STEP_FIXED  FixedPin<PORTBASE_E,3>
+#define Y_MIN_FIXED   FixedPin<PORTBASE_F,4>
+#define Y_MAX_FIXED   NoFixedPin
+#define Z_STEP_FIXED  FixedPin<PORTBASE_K,0>
+#define Z_MIN_FIXED   NoFixedPin
+#define Z_MAX_FIXED   FixedPin<PORTBASE_F,7>
+#define A_STEP_FIXED  FixedPin<PORTBASE_K,3>
+#define A_MIN_FIXED   NoFixedPin
+#define A_MAX_FIXED   NoFixedPin
+
 
 #define USE4BITMODE
 #define LCD_RS_PIN      Pin()
@@ -6,6 +6,11 @@ use IO::Select;
 local $|=1;
 
 my $use_sjfwcrc = 0;
+# Send binary packets (M321) instead of text; see GcodeQueue.h.
+my $use_binary = 0;
+# Keep as many lines in flight as the printer's receive buffer holds (M322),
+# rather than waiting for each ok.
+my $use_window = 0;
 
 
 
@@ -34,6 +39,18 @@ my $s = IO::Select->new(\*STDIN);
 my $bufmax = 1;
 my $bufsize = 0;
 
+# Window mode: the printer's receive buffer size, from the ok to M322 P1, and
+# the bytes of each line not yet answered.  The firmware only answers a line
+# once it's out of the buffer, so keeping the total under its size can't
+# overrun it.
+my $rxsize = 0;
+my @inflight = ();
+my $inflight_bytes = 0;
+# After an rs, the lines already sent behind the bad one will each be refused
+# in turn; they're in the resend anyway.
+my $discard = 0;
+my $pending;
+
 my $resend = 0;
 my @linehist = ();
 my $linenum = 0;
@@ -60,6 +77,71 @@ sub addcrc($$)
   $l .= "*".$ck."\n";
 }
 
+sub room($)
+{
+  my $len = shift;
+  return $inflight_bytes + $len < $rxsize if $rxsize;
+  return $bufsize < $bufmax;
+}
+
+sub sendline($)
+{
+  my $l = shift;
+  print PH $l;
+  push @inflight, length($l);
+  $inflight_bytes += length($l);
+  $bufsize++;
+}
+
+sub answered()
+{
+  $inflight_bytes -= shift(@inflight) if @inflight;
+  $bufsize--;
+}
+
+sub crc16($)
+{
+  my $crc = 0xFFFF;
+  foreach my $c (unpack('C*', shift))
+  {
+    $crc ^= $c << 8;
+    for(1..8)
+    {
+      $crc = ($crc & 0x8000) ? (($crc << 1) ^ 0x1021) : ($crc << 1);
+      $crc &= 0xFFFF;
+    }
+  }
+  return $crc;
+}
+
+sub addpacket($$)
+{
+  my $l = shift;
+  my $n = shift;
+
+  my %vals = ();
+  foreach my $w (split(' ', $l))
+  {
+    $vals{uc(substr($w, 0, 1))} = substr($w, 1);
+  }
+  my $intaxes = defined($vals{M}) && $vals{M} >= 300;
+
+  # Bit 0 is A; see GcodeQueue.h
+  my $present = 0;
+  my $data = '';
+  for my $x (0..25)
+  {
+    my $c = chr(ord('A') + $x);
+    next unless defined($vals{$c});
+    $present |= 1 << $x;
+    if($c =~ /[DGHLMPST]/ || ($c =~ /[XYZE]/ && $intaxes)) { $data .= pack('l<', int($vals{$c})); }
+    else                                                   { $data .= pack('f<', $vals{$c}); }
+  }
+
+  my $p = pack('CvV', 6 + length($data), $n & 0xFFFF, $present) . $data;
+  return pack('C', 0xA5) . $p . pack('v', crc16($p));
+}
+
 
 
 my $t1 = time();
@@ -67,7 +149,7 @@ my $t1 = time();
 my $line = '';
 while(1)
 {
-  if($resend and $bufsize < $bufmax)
+  if($resend)
   {
     my $numhist = scalar @linehist;
     if($resend > $numhist)
@@ -78,11 +160,13 @@ while(1)
     else
     {
       my ($rn, $rl) = ($linehist[$resend-1][0], $linehist[$resend-1][1]);
-      $rl = addcrc($rl, $rn);
-      print "REPEAT: " . $rl;
-      print PH $rl;
-      $resend++;
-      $bufsize++;
+      $rl = $use_binary ? addpacket($rl, $rn) : addcrc($rl, $rn);
+      if(room(length($rl)))
+      {
+        print "REPEAT: N$rn $linehist[$resend-1][1]\n";
+        sendline($rl);
+        $resend++;
+      }
     }
   }
   elsif($started == 1)
@@ -93,14 +177,37 @@ while(1)
       my $line = "M118 P1"; 
       push @linehist, [$linenum, $line];
       $line = addcrc($line, $linenum);
-      print PH $line;
       print '> ' . $line;
-      $bufsize++;
+      sendline($line);
       $linenum++;
       $SJFW_CRC = 1;
     }
+    if($use_window == 1)
+    {
+      my $line = "M322 P1";
+      push @linehist, [$linenum, $line];
+      $line = addcrc($line, $linenum);
+      print '> ' . $line;
+      sendline($line);
+      $linenum++;
+    }
+    if($use_binary == 1)
+    {
+      # Goes as text; the firmware expects packets from line 1 once it's ok'd.
+      print "> M321\n";
+      sendline("M321\n");
+      $linenum = 1;
+    }
+  }
+  elsif(defined($pending))
+  {
+    if(room(length($pending)))
+    {
+      sendline($pending);
+      undef $pending;
+    }
   }
-  elsif($bufsize < $bufmax and scalar $s->can_read(0) and $started > 1)
+  elsif(scalar $s->can_read(0) and $started > 1)
   {
     my $char;
     if(sysread(STDIN,$char,1) != 1)
@@ -120,13 +227,10 @@ while(1)
 
       push @linehist, [$linenum, $line];
 
-      $line = addcrc($line, $linenum);
-
-      print PH $line;
-      print '> ' . $line;
+      print '> ' . $line . "\n";
+      $pending = $use_binary ? addpacket($line, $linenum) : addcrc($line, $linenum);
 
       $line = '';
-      $bufsize++;
       $linenum++;
     }
   }
@@ -148,22 +252,32 @@ while(1)
 
     if($line =~ m/^ok/)
     {
-      $bufsize--;
+      answered();
+      $rxsize = $1 if(!$rxsize and $use_window and $line =~ m/ B:(\d+)/);
     }
     elsif($line =~ m/Discard/)
     {
-      $bufsize--;
+      answered();
     }
     elsif($line =~ m/^rs (\d+)/)
     {
-      my $badline = $1;
-      print "Need to resend $badline.\n";
-      while((scalar @linehist) and $linehist[0][0] < $badline)
+      answered();
+      if($discard)
+      {
+        $discard--;
+      }
+      else
       {
-        shift @linehist;
+        my $badline = $1;
+        print "Need to resend $badline.\n";
+        while((scalar @linehist) and $linehist[0][0] < $badline)
+        {
+          shift @linehist;
+        }
+        $resend = 1;
+        $discard = $bufsize;
+        undef $pending;
       }
-      $resend = 1;
-      $bufsize--;
     }
     elsif($line =~ m/start/)
     {
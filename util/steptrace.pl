@@ -0,0 +1,110 @@
+#!/usr/bin/perl
+# Decodes the step trace M312 dumps (firmware built with STEP_TRACE).
+#
+# Feed it whatever the host captured from the printer; it looks for the
+# "trace <entries>" line and reads the binary entries after it.  See
+# StepTrace.h for the layout.
+#
+#   steptrace.pl capture.log        one line per move: planned vs actual ramps
+#   steptrace.pl -c capture.log     CSV of every pass: time, steps/s and
+#                                   steps/s/s per axis, unsmoothed
+use strict;
+
+my $csv = 0;
+if(@ARGV && $ARGV[0] eq '-c')
+{
+  $csv = 1;
+  shift @ARGV;
+}
+
+local $/;
+my $data = <>;
+$data =~ /trace (\d+)\n/s || die("No trace found.\n");
+my $count = $1;
+my $raw = substr($data, $+[0], $count * 5);
+die("Trace cut short.\n") if length($raw) < $count * 5;
+
+my @axisname = ('X', 'Y', 'Z', 'E');
+my @moves = ();
+my $move;
+my $time = 0;
+my @lastrate = (0, 0, 0, 0);
+
+print("time," . join(',', map { "$_ steps/s,$_ steps/s/s" } @axisname) . "\n") if $csv;
+
+for(my $x=0;$x<$count;$x++)
+{
+  my ($kind, $steps, $value) = unpack('Cvv', substr($raw, $x*5, 5));
+
+  if($kind & 0x80)
+  {
+    if($kind == 0x80)
+    {
+      $move = { line => $value, lead => $steps, passes => [] };
+      push(@moves, $move);
+    }
+    elsif($move)
+    {
+      $move->{$kind == 0x81 ? 'accel' : 'decel'} = $value;
+    }
+    next;
+  }
+
+  my $dt = $value / 1000000;
+  $time += $dt;
+  my @n = map { ($steps >> ($_ * 4)) & 0xF } 0..3;
+  my @rate = map { $dt > 0 ? $n[$_] / $dt : 0 } 0..3;
+
+  if($csv)
+  {
+    my @cols = ();
+    for my $ax (0..3)
+    {
+      my $v = ($kind >> $ax) & 1 ? $rate[$ax] : -$rate[$ax];
+      my $a = $dt > 0 ? ($v - $lastrate[$ax]) / $dt : 0;
+      $lastrate[$ax] = $v;
+      push(@cols, sprintf("%.1f,%.0f", $v, $a));
+    }
+    printf("%.6f,%s\n", $time, join(',', @cols));
+  }
+
+  push(@{$move->{passes}}, [ $n[$move->{lead}], $rate[$move->{lead}] ]) if $move;
+}
+exit(0) if $csv;
+
+# The trace is a ring, so the oldest move may be missing its start.
+print("line  axis  steps  accel plan/real  decel plan/real  entry  peak  exit (steps/s)\n");
+foreach my $m (@moves)
+{
+  my @p = @{$m->{passes}};
+  next unless @p;
+
+  # The first pass of a move can't tell how long the axes sat idle before it.
+  my $peak = 0;
+  my $total = 0;
+  for my $i (0..$#p)
+  {
+    $total += $p[$i][0];
+    $peak = $p[$i][1] if $i && $p[$i][1] > $peak;
+  }
+
+  # Accel runs until we're within 1% of the peak, and decel from the last
+  # pass that was.
+  my ($accel, $decel, $seen) = (0, 0, 0);
+  for my $i (1..$#p)
+  {
+    if($p[$i][1] >= $peak * 0.99)
+    {
+      $seen = 1;
+      $decel = 0;
+      next;
+    }
+    if($seen) { $decel += $p[$i][0]; }
+    else      { $accel += $p[$i][0]; }
+  }
+  $accel += $p[0][0] if $accel;
+
+  printf("%-5d %-4s %6d  %6d/%-6d    %6d/%-6d    %5.0f  %5.0f %5.0f\n",
+    $m->{line}, $axisname[$m->{lead}], $total, $m->{accel}, $accel, $m->{decel}, $decel,
+    @p > 1 ? $p[1][1] : $p[0][1], $peak, $p[-1][1]);
+}